@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesystem.h"
+#include "attr_index.h"
+
+#define MAX_INDEXED_IMAGES 16
+
+typedef struct {
+    int fd;                         // -1 = unused
+    int32_t size[MAX_FILES];        // -1 = empty slot
+    int32_t type[MAX_FILES];
+    int32_t owner[MAX_FILES];
+    int order[MAX_FILES];           // slots by size, largest first, empty slots last
+    int rank[MAX_FILES];            // position of each slot in order
+    type_usage usage[MAX_FILES];    // one bucket per type in use
+    int usage_count;
+} attr_index;
+
+static attr_index *indexes[MAX_INDEXED_IMAGES];
+
+
+static void usage_add(attr_index *ix, int32_t type, int32_t files, int64_t bytes) {
+    int b = 0;
+    while (b < ix->usage_count && ix->usage[b].type != type) b++;
+    if (b == ix->usage_count) {
+        ix->usage[b] = (type_usage){ type, 0, 0 };
+        ix->usage_count++;
+    }
+
+    ix->usage[b].files += files;
+    ix->usage[b].bytes += bytes;
+    if (ix->usage[b].files == 0)
+        ix->usage[b] = ix->usage[--ix->usage_count];
+}
+
+// Slide slot i up or down the order until its neighbours are in size order
+static void reposition(attr_index *ix, int i) {
+    int r = ix->rank[i];
+    int32_t s = ix->size[i];
+
+    while (r > 0 && ix->size[ix->order[r - 1]] < s) {
+        ix->order[r] = ix->order[r - 1];
+        ix->rank[ix->order[r]] = r;
+        r--;
+    }
+    while (r + 1 < MAX_FILES && ix->size[ix->order[r + 1]] > s) {
+        ix->order[r] = ix->order[r + 1];
+        ix->rank[ix->order[r]] = r;
+        r++;
+    }
+    ix->order[r] = i;
+    ix->rank[i] = r;
+}
+
+static void set_slot(attr_index *ix, int i, const file_metadata *meta) {
+    if (ix->size[i] >= 0) usage_add(ix, ix->type[i], -1, -(int64_t)ix->size[i]);
+
+    if (meta->name[0] == 0) {
+        ix->size[i] = -1;
+        ix->type[i] = 0;
+        ix->owner[i] = 0;
+    } else {
+        ix->size[i] = meta->size;
+        ix->type[i] = meta->type;
+        ix->owner[i] = FILE_OWNER(meta->permission);
+        usage_add(ix, meta->type, 1, meta->size);
+    }
+    reposition(ix, i);
+}
+
+/* Find the index for fd, building it from one read of the metadata table
+ * the first time. NULL if it could not be built. */
+static attr_index *get_index(int fd) {
+    int free_slot = -1;
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i] && indexes[i]->fd == fd) return indexes[i];
+        if (!indexes[i] && free_slot == -1) free_slot = i;
+    }
+    if (free_slot == -1) return NULL;
+
+    size_t table_size = sizeof(file_metadata) * MAX_FILES;
+    file_metadata *table = malloc(table_size);
+    attr_index *ix = malloc(sizeof(*ix));
+    if (!table || !ix ||
+        pread(fd, table, table_size, sizeof(file_system_header)) != (ssize_t)table_size) {
+        free(table);
+        free(ix);
+        return NULL;
+    }
+
+    ix->usage_count = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        ix->size[i] = -1;
+        ix->order[i] = i;
+        ix->rank[i] = i;
+    }
+    for (int i = 0; i < MAX_FILES; i++)
+        set_slot(ix, i, &table[i]);
+    free(table);
+
+    ix->fd = fd;
+    indexes[free_slot] = ix;
+    return ix;
+}
+
+void attr_index_update(int fd, int index, const file_metadata *meta) {
+    if (index < 0 || index >= MAX_FILES) return;
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i] && indexes[i]->fd == fd) {
+            set_slot(indexes[i], index, meta);
+            return;
+        }
+    }
+}
+
+void attr_index_drop(int fd) {
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i] && indexes[i]->fd == fd) {
+            free(indexes[i]);
+            indexes[i] = NULL;
+        }
+    }
+}
+
+static attr_entry entry_for(const attr_index *ix, int i) {
+    return (attr_entry){ i, ix->size[i], ix->type[i], ix->owner[i] };
+}
+
+int attr_index_top(int fd, int n, attr_entry *out) {
+    attr_index *ix = get_index(fd);
+    if (!ix) return -1;
+
+    int count = 0;
+    while (count < n && count < MAX_FILES && ix->size[ix->order[count]] >= 0) {
+        out[count] = entry_for(ix, ix->order[count]);
+        count++;
+    }
+    return count;
+}
+
+// Largest first, like attr_index_top
+int attr_index_by_type(int fd, int32_t type, attr_entry *out, int max) {
+    attr_index *ix = get_index(fd);
+    if (!ix) return -1;
+
+    int count = 0;
+    for (int r = 0; r < MAX_FILES && count < max; r++) {
+        int i = ix->order[r];
+        if (ix->size[i] < 0) break;
+        if (ix->type[i] == type) out[count++] = entry_for(ix, i);
+    }
+    return count;
+}
+
+static int by_bytes_desc(const void *a, const void *b) {
+    int64_t x = ((const type_usage *)a)->bytes, y = ((const type_usage *)b)->bytes;
+    return (x < y) - (x > y);
+}
+
+int attr_index_usage(int fd, type_usage *out, int max) {
+    attr_index *ix = get_index(fd);
+    if (!ix) return -1;
+
+    // Bucket order is free, so sort in place and hand out the head
+    qsort(ix->usage, ix->usage_count, sizeof(type_usage), by_bytes_desc);
+    int count = ix->usage_count < max ? ix->usage_count : max;
+    memcpy(out, ix->usage, sizeof(type_usage) * count);
+    return count;
+}
@@ -0,0 +1,36 @@
+#ifndef ATTR_INDEX_H
+#define ATTR_INDEX_H
+
+#include <stdint.h>
+
+#include "filesystem.h"
+
+// In-memory secondary index over the live metadata table's size, type and
+// owner, built on first query for each image fd. Slots are kept ordered by
+// size, largest first, and per-type file counts and byte totals are kept
+// alongside, so "largest files", "files of type X" and "bytes per type"
+// never read the table. write_metadata keeps it up to date; a size change
+// only moves the slot past the files it overtakes.
+
+typedef struct {
+    int index;          // metadata slot
+    int32_t size;
+    int32_t type;
+    int32_t owner;      // FILE_OWNER(permission)
+} attr_entry;
+
+typedef struct {
+    int32_t type;
+    int32_t files;
+    int64_t bytes;
+} type_usage;
+
+void attr_index_update(int file_descriptor, int index, const file_metadata *meta);
+void attr_index_drop(int file_descriptor);
+
+// Each returns the number of entries written to out, or -1 without an index.
+int attr_index_top(int file_descriptor, int n, attr_entry *out);
+int attr_index_by_type(int file_descriptor, int32_t type, attr_entry *out, int max);
+int attr_index_usage(int file_descriptor, type_usage *out, int max);   // most bytes first
+
+#endif
@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "filesystem.h"
+#include "attr_index.h"
+#include "writeback.h"
+#include "batch.h"
+
+typedef enum {
+    OP_OPEN, OP_CLOSE, OP_READ, OP_WRITE, OP_SREAD, OP_SWRITE, OP_SEEK,
+    OP_RM, OP_STAT, OP_SHRINK, OP_CLONE, OP_FSSTAT, OP_FLUSH, OP_FALLOCATE,
+    OP_PUNCH, OP_SYNC, OP_CHTYPE, OP_CHOWN, OP_IMPORT, OP_EXPORT,
+    OP_TOP, OP_LS_TYPE, OP_DU_BY_TYPE, OP_ALLOC, OP_FREE, OP_VIZ, OP_WBSTAT,
+    OP_SNAP_CREATE, OP_SNAP_DELETE, OP_SNAP_MOUNT, OP_SNAP_UNMOUNT, OP_SNAP_LIST,
+    OP_COUNT
+} op_kind;
+
+static const char *op_names[OP_COUNT] = {
+    "open", "close", "read", "write", "sread", "swrite", "seek",
+    "rm", "stat", "shrink", "clone", "fsstat", "flush", "fallocate",
+    "punch", "sync", "chtype", "chown", "import", "export",
+    "top", "ls-type", "du-by-type", "alloc", "free", "viz", "wbstat",
+    "snap-create", "snap-delete", "snap-mount", "snap-unmount", "snap-list"
+};
+
+typedef struct {
+    op_kind kind;
+    int32_t pos;
+    int32_t n;
+    char name[64];
+    char arg[128];
+} batch_op;
+
+typedef struct {
+    long count[OP_COUNT];
+    double seconds[OP_COUNT];
+} batch_stats;
+
+typedef struct {
+    int fd;
+    batch_op **ops;         // this worker's operations, in script order
+    long op_count;
+    FILE *out;
+    batch_stats stats;
+} batch_worker;
+
+// The filesystem API keeps its state on one fd and is not thread-safe,
+// so workers take turns inside it.
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int is_word(const char *line, const char *word) {
+    size_t n = strlen(word);
+    return strncmp(line, word, n) == 0 && (line[n] == '\n' || line[n] == 0);
+}
+
+// Same syntax and commands as the interactive shell. Returns 0 and fills op, or -1.
+static int parse_op(const char *line, batch_op *op) {
+    memset(op, 0, sizeof(*op));
+
+    if (sscanf(line, "open %63s %127s", op->name, op->arg) == 2) op->kind = OP_OPEN;
+    else if (sscanf(line, "read %63s %d %d", op->name, &op->pos, &op->n) == 3) op->kind = OP_READ;
+    else if (sscanf(line, "write %63s %d %127s", op->name, &op->pos, op->arg) == 3) op->kind = OP_WRITE;
+    else if (sscanf(line, "sread %63s %d", op->name, &op->n) == 2) op->kind = OP_SREAD;
+    else if (sscanf(line, "swrite %63s %127s", op->name, op->arg) == 2) op->kind = OP_SWRITE;
+    else if (sscanf(line, "seek %63s %d", op->name, &op->pos) == 2) op->kind = OP_SEEK;
+    else if (sscanf(line, "shrink %63s %d", op->name, &op->n) == 2) op->kind = OP_SHRINK;
+    else if (sscanf(line, "clone %63s %127s", op->name, op->arg) == 2) op->kind = OP_CLONE;
+    else if (sscanf(line, "fallocate %63s %d", op->name, &op->n) == 2) op->kind = OP_FALLOCATE;
+    else if (sscanf(line, "punch %63s %d %d", op->name, &op->pos, &op->n) == 3) op->kind = OP_PUNCH;
+    else if (sscanf(line, "chtype %63s %d", op->name, &op->n) == 2) op->kind = OP_CHTYPE;
+    else if (sscanf(line, "chown %63s %d", op->name, &op->n) == 2) op->kind = OP_CHOWN;
+    else if (sscanf(line, "flush %63s", op->name) == 1) op->kind = OP_FLUSH;
+    else if (sscanf(line, "close %63s", op->name) == 1) op->kind = OP_CLOSE;
+    else if (sscanf(line, "rm %63s", op->name) == 1) op->kind = OP_RM;
+    else if (sscanf(line, "stat %63s", op->name) == 1) op->kind = OP_STAT;
+    else if (sscanf(line, "import %127s %63s", op->arg, op->name) == 2) op->kind = OP_IMPORT;
+    else if (sscanf(line, "export %63s %127s", op->name, op->arg) == 2) op->kind = OP_EXPORT;
+    else if (sscanf(line, "top %d", &op->n) == 1) op->kind = OP_TOP;
+    else if (sscanf(line, "ls-type %d", &op->n) == 1) op->kind = OP_LS_TYPE;
+    else if (sscanf(line, "alloc %d", &op->n) == 1) op->kind = OP_ALLOC;
+    else if (sscanf(line, "free %d %d", &op->pos, &op->n) == 2) op->kind = OP_FREE;
+    else if (sscanf(line, "snapshot create %63s", op->name) == 1) op->kind = OP_SNAP_CREATE;
+    else if (sscanf(line, "snapshot delete %63s", op->name) == 1) op->kind = OP_SNAP_DELETE;
+    else if (sscanf(line, "snapshot mount %63s", op->name) == 1) op->kind = OP_SNAP_MOUNT;
+    else if (is_word(line, "snapshot unmount")) op->kind = OP_SNAP_UNMOUNT;
+    else if (is_word(line, "snapshot list")) op->kind = OP_SNAP_LIST;
+    else if (is_word(line, "du-by-type")) op->kind = OP_DU_BY_TYPE;
+    else if (is_word(line, "viz")) op->kind = OP_VIZ;
+    else if (is_word(line, "wbstat")) op->kind = OP_WBSTAT;
+    else if (is_word(line, "fsstat")) op->kind = OP_FSSTAT;
+    else if (is_word(line, "sync")) op->kind = OP_SYNC;
+    else return -1;
+
+    return 0;
+}
+
+/* Parse the whole script up front. 'exit' ends it, as in the shell. Any
+ * unknown command fails the load, so a replayed trace never runs with
+ * operations silently missing. */
+static batch_op *load_script(const char *path, long *count) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+
+    long cap = 1024, len = 0, lineno = 0, unknown = 0;
+    batch_op *ops = malloc(cap * sizeof(*ops));
+    char line[256];
+
+    while (ops && fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (is_word(line, "exit")) break;
+
+        if (len == cap) {
+            cap *= 2;
+            batch_op *grown = realloc(ops, cap * sizeof(*ops));
+            if (!grown) { free(ops); ops = NULL; break; }
+            ops = grown;
+        }
+
+        if (parse_op(line, &ops[len]) != 0) {
+            fprintf(stderr, "%s:%ld: unknown command: %s", path, lineno, line);
+            unknown++;
+            continue;
+        }
+        len++;
+    }
+
+    fclose(f);
+    if (ops && unknown > 0) {
+        fprintf(stderr, "%s: %ld unknown command(s); nothing was run.\n", path, unknown);
+        free(ops);
+        return NULL;
+    }
+    *count = len;
+    return ops;
+}
+
+static int handle_for(int fd, const char *name, FILE *out) {
+    int idx = find_file_by_name(fd, name);
+    if (idx == -1) {
+        fprintf(out, "File not found.\n");
+        return -1;
+    }
+    // Attached on first use, so 'open' never depends on a free handle
+    int h = stream_find(fd, idx);
+    if (h == -1 && (h = stream_open(fd, name, 0)) == -1)
+        fprintf(out, "No free stream handle for %s.\n", name);
+    return h;
+}
+
+static void print_entries(int fd, const attr_entry *entries, int count, FILE *out) {
+    file_metadata meta;
+    for (int i = 0; i < count; i++) {
+        if (read_metadata(fd, entries[i].index, &meta) != 0) continue;
+        fprintf(out, "  %-24s %10d bytes  type %d  owner %d\n", meta.name,
+                entries[i].size, entries[i].type, entries[i].owner);
+    }
+}
+
+// Run one operation; mirrors the interactive shell's output.
+static void execute_op(int fd, const batch_op *op, FILE *out) {
+    char buf[4096];
+    int idx, h, r;
+
+    switch (op->kind) {
+    case OP_OPEN: {
+        file_handler fh = open_file(fd, op->name, strstr(op->arg, "CREATE") ? CREATE : 0);
+        if (!fh.is_open) { fprintf(out, "Failed to open %s.\n", op->name); break; }
+        // Only DELAY needs its handle now, to keep the flag
+        if (strstr(op->arg, "DELAY") && stream_find(fd, fh.metadata_index) == -1 &&
+            stream_open(fd, op->name, DELAY_ALLOC) == -1)
+            fprintf(out, "No free stream handle: writes to %s are not delayed.\n", op->name);
+        fprintf(out, "Opened file %s.\n", op->name);
+        break;
+    }
+
+    case OP_CLOSE:
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "Close failed.\n"); break; }
+        h = stream_find(fd, idx);
+        fprintf(out, (h == -1 || stream_close(h) == 0) ? "Closed %s.\n" : "Close failed.\n", op->name);
+        break;
+
+    case OP_READ: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        file_handler fh = { idx, 0, 1 };
+        int32_t n = op->n > (int32_t)sizeof(buf) - 1 ? (int32_t)sizeof(buf) - 1 : op->n;
+        r = fs_read(fd, &fh, op->pos, n, buf);
+        if (r > 0) { buf[r] = '\0'; fprintf(out, "Read: %s\n", buf); }
+        else fprintf(out, "Nothing read.\n");
+        break;
+    }
+
+    case OP_WRITE: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        file_handler fh = { idx, 0, 1 };
+        fprintf(out, "Wrote %d bytes.\n", fs_write(fd, &fh, op->pos, op->arg, strlen(op->arg)));
+        break;
+    }
+
+    case OP_SREAD: {
+        if ((h = handle_for(fd, op->name, out)) == -1) break;
+        int32_t n = op->n > (int32_t)sizeof(buf) - 1 ? (int32_t)sizeof(buf) - 1 : op->n;
+        r = stream_read(h, buf, n);
+        if (r > 0) { buf[r] = '\0'; fprintf(out, "Read: %s\n", buf); }
+        else fprintf(out, "Nothing read.\n");
+        break;
+    }
+
+    case OP_SWRITE:
+        if ((h = handle_for(fd, op->name, out)) == -1) break;
+        fprintf(out, "Wrote %d bytes.\n", stream_write(h, op->arg, strlen(op->arg)));
+        break;
+
+    case OP_SEEK:
+        if ((h = handle_for(fd, op->name, out)) == -1) break;
+        fprintf(out, "Position %d.\n", stream_seek(h, op->pos, SEEK_SET));
+        break;
+
+    case OP_FLUSH:
+        if ((h = handle_for(fd, op->name, out)) == -1) break;
+        fprintf(out, stream_flush(h) == 0 ? "Flushed %s.\n" : "Flush failed.\n", op->name);
+        break;
+
+    case OP_FALLOCATE: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        file_handler fh = { idx, 0, 1 };
+        if (fs_fallocate(fd, &fh, op->n) == 0)
+            fprintf(out, "Reserved %d bytes for %s.\n", op->n, op->name);
+        else
+            fprintf(out, "Fallocate failed.\n");
+        break;
+    }
+
+    case OP_PUNCH: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        file_handler fh = { idx, 0, 1 };
+        if (fs_punch_hole(fd, &fh, op->pos, op->n) == 0)
+            fprintf(out, "Punched %d bytes at %d in %s.\n", op->n, op->pos, op->name);
+        else
+            fprintf(out, "Punch failed.\n");
+        break;
+    }
+
+    case OP_RM: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        h = stream_find(fd, idx);
+        file_handler fh = { idx, 0, 1 };
+        if ((h == -1 || stream_close(h) == 0) && rm_file(fd, &fh) == 0)
+            fprintf(out, "Removed %s.\n", op->name);
+        else
+            fprintf(out, "Remove failed.\n");
+        break;
+    }
+
+    case OP_STAT: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        file_handler fh = { idx, 0, 1 };
+        get_file_stats(fd, &fh, out);
+        break;
+    }
+
+    case OP_SHRINK: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        file_handler fh = { idx, 0, 1 };
+        if (shrink_file(fd, &fh, op->n) == 0)
+            fprintf(out, "File %s shrunk to %d bytes.\n", op->name, op->n);
+        else
+            fprintf(out, "Shrink failed.\n");
+        break;
+    }
+
+    case OP_CHTYPE:
+    case OP_CHOWN: {
+        idx = find_file_by_name(fd, op->name);
+        if (idx == -1) { fprintf(out, "File not found.\n"); break; }
+        file_handler fh = { idx, 0, 1 };
+        int owner = op->kind == OP_CHOWN;
+        r = owner ? fs_set_owner(fd, &fh, op->n) : fs_set_type(fd, &fh, op->n);
+        if (r == 0) fprintf(out, "Set %s of %s to %d.\n", owner ? "owner" : "type", op->name, op->n);
+        else fprintf(out, "Change failed.\n");
+        break;
+    }
+
+    case OP_CLONE:
+        if (fs_clone(fd, op->name, op->arg) == 0)
+            fprintf(out, "Cloned %s to %s.\n", op->name, op->arg);
+        else
+            fprintf(out, "Clone failed.\n");
+        break;
+
+    case OP_FSSTAT:
+        get_fs_stats(fd, out);
+        break;
+
+    case OP_SYNC:
+        fprintf(out, fs_sync(fd) == 0 ? "Synced.\n" : "Sync failed.\n");
+        break;
+
+    case OP_IMPORT:
+        r = fs_import(fd, op->arg, op->name);
+        if (r >= 0) fprintf(out, "Imported %d bytes into %s.\n", r, op->name);
+        else fprintf(out, "Import failed.\n");
+        break;
+
+    case OP_EXPORT:
+        r = fs_export(fd, op->name, op->arg);
+        if (r >= 0) fprintf(out, "Exported %d bytes to %s.\n", r, op->arg);
+        else fprintf(out, "Export failed.\n");
+        break;
+
+    case OP_TOP:
+    case OP_LS_TYPE: {
+        if (snapshot_mounted(fd)) { fprintf(out, "Unmount the snapshot first.\n"); break; }
+        attr_entry entries[MAX_FILES];
+        int count = op->kind == OP_TOP ? attr_index_top(fd, op->n, entries)
+                                       : attr_index_by_type(fd, op->n, entries, MAX_FILES);
+        if (count < 0) { fprintf(out, "Attribute index unavailable.\n"); break; }
+        print_entries(fd, entries, count, out);
+        fprintf(out, "%d file(s)\n", count);
+        break;
+    }
+
+    case OP_DU_BY_TYPE: {
+        if (snapshot_mounted(fd)) { fprintf(out, "Unmount the snapshot first.\n"); break; }
+        type_usage usage[MAX_FILES];
+        int count = attr_index_usage(fd, usage, MAX_FILES);
+        if (count < 0) { fprintf(out, "Attribute index unavailable.\n"); break; }
+        for (int i = 0; i < count; i++)
+            fprintf(out, "  type %-6d %6d file(s) %12lld bytes\n", usage[i].type,
+                    usage[i].files, (long long)usage[i].bytes);
+        fprintf(out, "%d type(s)\n", count);
+        break;
+    }
+
+    case OP_ALLOC:
+        r = allocate_space(fd, op->n);
+        if (r == -1) fprintf(out, "alloc failed: no suitable free block\n");
+        else fprintf(out, "Allocated %d bytes at offset %d\n", op->n, r);
+        break;
+
+    case OP_FREE:
+        if (free_space(fd, op->pos, op->n) == 0)
+            fprintf(out, "Freed %d bytes starting at %d\n", op->n, op->pos);
+        else
+            fprintf(out, "Free failed.\n");
+        break;
+
+    // These print to stdout; as barriers they run alone, after the
+    // output of every earlier operation has been written there
+    case OP_VIZ:
+        print_free_list(fd);
+        break;
+
+    case OP_WBSTAT:
+        writeback_stats(fd);
+        break;
+
+    case OP_SNAP_LIST:
+        snapshot_list(fd);
+        break;
+
+    case OP_SNAP_CREATE:
+        fprintf(out, snapshot_create(fd, op->name) == 0 ? "Snapshot %s created.\n"
+                                                        : "Snapshot failed.\n", op->name);
+        break;
+
+    case OP_SNAP_DELETE:
+        fprintf(out, snapshot_delete(fd, op->name) == 0 ? "Snapshot %s deleted.\n"
+                                                        : "Delete failed.\n", op->name);
+        break;
+
+    case OP_SNAP_MOUNT:
+        fprintf(out, snapshot_mount(fd, op->name) == 0 ? "Snapshot %s mounted read-only.\n"
+                                                       : "Snapshot not found.\n", op->name);
+        break;
+
+    case OP_SNAP_UNMOUNT:
+        fprintf(out, snapshot_unmount(fd) == 0 ? "Snapshot unmounted.\n" : "No snapshot mounted.\n");
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void run_op(batch_worker *w, const batch_op *op, FILE *out) {
+    pthread_mutex_lock(&fs_mutex);
+    double t0 = now_seconds();
+    execute_op(w->fd, op, out);
+    double t1 = now_seconds();
+    pthread_mutex_unlock(&fs_mutex);
+
+    w->stats.count[op->kind]++;
+    w->stats.seconds[op->kind] += t1 - t0;
+}
+
+static void *run_worker(void *arg) {
+    batch_worker *w = arg;
+
+    for (long i = 0; i < w->op_count; i++)
+        run_op(w, w->ops[i], w->out);
+    return NULL;
+}
+
+// Operations on more than one file or on the whole image. Each runs alone,
+// after every earlier operation in the script and before any later one.
+static int is_barrier(const batch_op *op) {
+    switch (op->kind) {
+    case OP_CLONE: case OP_FSSTAT: case OP_SYNC:
+    case OP_TOP: case OP_LS_TYPE: case OP_DU_BY_TYPE:
+    case OP_ALLOC: case OP_FREE: case OP_VIZ: case OP_WBSTAT:
+    case OP_SNAP_CREATE: case OP_SNAP_DELETE: case OP_SNAP_MOUNT:
+    case OP_SNAP_UNMOUNT: case OP_SNAP_LIST:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Route every operation on a file to the same worker (djb2 on the name)
+static int worker_for(const batch_op *op, int jobs) {
+    uint32_t h = 5381;
+    for (const char *p = op->name; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    return h % jobs;
+}
+
+static void print_report(const batch_stats *stats, long total, double elapsed, int jobs) {
+    fprintf(stderr, "\nBatch: %ld ops in %.3f s (%.0f ops/s, %d job%s)\n",
+            total, elapsed, elapsed > 0 ? total / elapsed : 0.0, jobs, jobs == 1 ? "" : "s");
+    fprintf(stderr, "  %-12s %10s %12s %12s\n", "command", "count", "ops/s", "avg us");
+
+    for (int k = 0; k < OP_COUNT; k++) {
+        if (stats->count[k] == 0) continue;
+        double secs = stats->seconds[k];
+        fprintf(stderr, "  %-12s %10ld %12.0f %12.2f\n", op_names[k], stats->count[k],
+                secs > 0 ? stats->count[k] / secs : 0.0,
+                secs * 1e6 / stats->count[k]);
+    }
+}
+
+/* Run ops[0, count), none of them a barrier, on the workers in parallel. */
+static void run_phase(batch_worker *workers, int jobs, batch_op *ops, long count, batch_op **order) {
+    // Bucket the operations per worker, keeping script order within each
+    long counts[jobs];
+    memset(counts, 0, sizeof(counts));
+    for (long i = 0; i < count; i++)
+        counts[worker_for(&ops[i], jobs)]++;
+
+    long start = 0;
+    for (int j = 0; j < jobs; j++) {
+        workers[j].ops = order + start;
+        workers[j].op_count = 0;
+        start += counts[j];
+    }
+    for (long i = 0; i < count; i++) {
+        batch_worker *w = &workers[worker_for(&ops[i], jobs)];
+        w->ops[w->op_count++] = &ops[i];
+    }
+
+    if (jobs == 1) {
+        run_worker(&workers[0]);
+        return;
+    }
+    pthread_t threads[jobs];
+    for (int j = 0; j < jobs; j++)
+        pthread_create(&threads[j], NULL, run_worker, &workers[j]);
+    for (int j = 0; j < jobs; j++)
+        pthread_join(threads[j], NULL);
+}
+
+int run_batch(int file_descriptor, const char *script_path, int jobs) {
+    long total = 0;
+    batch_op *ops = load_script(script_path, &total);
+    if (!ops) return -1;
+
+    if (jobs < 1) jobs = 1;
+
+    batch_worker *workers = calloc(jobs, sizeof(*workers));
+    batch_op **order = malloc((total ? total : 1) * sizeof(*order));
+    if (!workers || !order) {
+        free(workers);
+        free(order);
+        free(ops);
+        return -1;
+    }
+    for (int j = 0; j < jobs; j++)
+        workers[j].fd = file_descriptor;
+
+    // One big stdout buffer for a single job; per-worker memory streams otherwise,
+    // copied out in worker order at each barrier
+    char *bufs[jobs];
+    size_t buf_lens[jobs];
+    if (jobs == 1) {
+        setvbuf(stdout, NULL, _IOFBF, 1 << 20);
+        workers[0].out = stdout;
+    } else {
+        for (int j = 0; j < jobs; j++) {
+            bufs[j] = NULL;
+            workers[j].out = open_memstream(&bufs[j], &buf_lens[j]);
+        }
+    }
+
+    double t0 = now_seconds();
+    for (long i = 0; i < total; ) {
+        long end = i;
+        while (end < total && !is_barrier(&ops[end])) end++;
+        run_phase(workers, jobs, ops + i, end - i, order);
+
+        if (jobs > 1) {
+            for (int j = 0; j < jobs; j++) {
+                fflush(workers[j].out);
+                fwrite(bufs[j], 1, buf_lens[j], stdout);
+                rewind(workers[j].out);
+            }
+        }
+        if (end < total) run_op(&workers[0], &ops[end], stdout);
+        i = end + 1;
+    }
+    double elapsed = now_seconds() - t0;
+
+    batch_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    for (int j = 0; j < jobs; j++) {
+        for (int k = 0; k < OP_COUNT; k++) {
+            stats.count[k] += workers[j].stats.count[k];
+            stats.seconds[k] += workers[j].stats.seconds[k];
+        }
+        if (jobs > 1) {
+            fclose(workers[j].out);
+            free(bufs[j]);
+        }
+    }
+    fflush(stdout);
+
+    print_report(&stats, total, elapsed, jobs);
+
+    free(workers);
+    free(order);
+    free(ops);
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Non-interactive batch mode: pre-parse a script or trace of shell commands
+// into an operation vector, replay it through the filesystem API with
+// buffered output and report throughput. jobs > 1 runs the operations of
+// different files on separate threads (per-file order is kept).
+int run_batch(int file_descriptor, const char *script_path, int jobs);
+
+#endif
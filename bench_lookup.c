@@ -0,0 +1,112 @@
+/* Microbenchmark for name lookups: find_file_by_name on hits and misses and
+ * find_free_metadata_slot, on a half-full and a full metadata table, for
+ * each name index mode (disk scan, scalar, SSE2, AVX2).
+
+   usage: bench_lookup [iterations]
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "filesystem.h"
+#include "name_index.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A bare image: header and zeroed metadata table are all lookups need
+static int make_image(char *path) {
+    int fd = mkstemp(path);
+    if (fd == -1) return -1;
+    unlink(path);
+
+    if (ftruncate(fd, data_region_offset()) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    file_system_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = 0xDEADBEEF;
+    header.file_system_version = FILE_SYSTEM_VERSION;
+    header.last_allocated_offset = data_region_offset();
+    header.free_list_head = -1;
+    write_fs_header(fd, &header);
+    return fd;
+}
+
+// Names are formatted up front so only the lookup is timed
+static char hit_names[MAX_FILES][64];
+static char miss_names[MAX_FILES][64];
+
+static void fill(int fd, int from, int to) {
+    for (int i = from; i < to; i++)
+        open_file(fd, hit_names[i], CREATE);
+}
+
+static double bench_lookups(int fd, char names[][64], int count, long iters) {
+    volatile int sink = 0;
+    double t0 = now_seconds();
+    for (long i = 0; i < iters; i++)
+        sink += find_file_by_name(fd, names[(i * 7919) % count]);
+    return (now_seconds() - t0) / iters * 1e9;
+}
+
+static double bench_free_slot(int fd, long iters) {
+    volatile int sink = 0;
+    double t0 = now_seconds();
+    for (long i = 0; i < iters; i++)
+        sink += find_free_metadata_slot(fd);
+    return (now_seconds() - t0) / iters * 1e9;
+}
+
+int main(int argc, char **argv) {
+    long iters = argc > 1 ? atol(argv[1]) : 200000;
+
+    const char *mode_names[] = { "disk scan", "scalar", "sse2", "avx2" };
+    int modes[] = { NAME_INDEX_OFF, NAME_INDEX_SCALAR, NAME_INDEX_SSE2, NAME_INDEX_AVX2 };
+
+    char path[] = "/tmp/bench_lookupXXXXXX";
+    int fd = make_image(path);
+    if (fd == -1) {
+        perror("image");
+        return 1;
+    }
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        snprintf(hit_names[i], sizeof(hit_names[i]), "file_%04d.dat", i);
+        snprintf(miss_names[i], sizeof(miss_names[i]), "missing_%04d.dat", i);
+    }
+
+    printf("%-10s %-6s %12s %12s %12s\n", "mode", "table", "hit ns", "miss ns", "free ns");
+
+    for (int full = 0; full <= 1; full++) {
+        int files = full ? MAX_FILES : MAX_FILES / 2;
+        fill(fd, full ? MAX_FILES / 2 : 0, files);
+
+        for (int m = 0; m < 4; m++) {
+            if (name_index_set_mode(modes[m]) == -1) {
+                printf("%-10s (not supported on this CPU)\n", mode_names[m]);
+                continue;
+            }
+            // The on-disk scan does a syscall per slot; keep its run short
+            long n = modes[m] == NAME_INDEX_OFF ? iters / 1000 + 1 : iters;
+
+            double hit = bench_lookups(fd, hit_names, files, n);
+            double miss = bench_lookups(fd, miss_names, MAX_FILES, n);
+            double free_slot = bench_free_slot(fd, n);
+            printf("%-10s %-6s %12.1f %12.1f %12.1f\n", mode_names[m],
+                   full ? "full" : "half", hit, miss, free_slot);
+        }
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,122 @@
+/* Throughput of a sharded volume as the shard count grows: T threads each
+ * write and read back 256-byte records in their own files, spread over
+ * 1, 2, 4, 8 and 16 shards.
+
+   usage: bench_volume dir [threads] [ops_per_thread]
+   Shard images are created as dir/shard<i>.db; point dir at the disk(s)
+   to test (or symlink the shard files onto different disks).
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "volume.h"
+
+#define RECORD_SIZE 256
+#define FILES_PER_THREAD 8
+#define SHARD_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    fs_volume *v;
+    int id;
+    long ops;
+    long failed;
+} bench_args;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *bench_thread(void *arg) {
+    bench_args *a = arg;
+    char name[32], record[RECORD_SIZE], back[RECORD_SIZE];
+    memset(record, 'a' + a->id % 26, sizeof(record));
+
+    for (long i = 0; i < a->ops; i++) {
+        snprintf(name, sizeof(name), "t%d_f%ld", a->id, i % FILES_PER_THREAD);
+        int32_t pos = (i / FILES_PER_THREAD % 16) * RECORD_SIZE;
+        if (i % 2 == 0) {
+            if (volume_write(a->v, name, pos, record, RECORD_SIZE) != RECORD_SIZE) a->failed++;
+        } else {
+            if (volume_read(a->v, name, pos, RECORD_SIZE, back) < 0) a->failed++;
+        }
+    }
+    return NULL;
+}
+
+static int run_round(const char *dir, int shards, int threads, long ops) {
+    char paths[MAX_SHARDS][512];
+    const char *path_ptrs[MAX_SHARDS];
+    for (int i = 0; i < shards; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/shard%d.db", dir, i);
+        unlink(paths[i]);
+        path_ptrs[i] = paths[i];
+    }
+
+    fs_volume v;
+    if (volume_open(&v, path_ptrs, shards, SHARD_SIZE) != 0) return -1;
+
+    // Files are created and sized up front so the timed loop never allocates
+    char name[32], zero[16 * RECORD_SIZE];
+    memset(zero, 0, sizeof(zero));
+    for (int t = 0; t < threads; t++) {
+        for (int f = 0; f < FILES_PER_THREAD; f++) {
+            snprintf(name, sizeof(name), "t%d_f%d", t, f);
+            volume_create(&v, name);
+            volume_write(&v, name, 0, zero, sizeof(zero));
+        }
+    }
+
+    pthread_t tids[threads];
+    bench_args args[threads];
+    double t0 = now_seconds();
+    for (int t = 0; t < threads; t++) {
+        args[t] = (bench_args){ &v, t, ops, 0 };
+        pthread_create(&tids[t], NULL, bench_thread, &args[t]);
+    }
+    long failed = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+        failed += args[t].failed;
+    }
+    double elapsed = now_seconds() - t0;
+
+    volume_close(&v);
+    for (int i = 0; i < shards; i++) unlink(paths[i]);
+
+    long total = ops * threads;
+    printf("  %6d %8d %10ld %10.3f %12.0f%s\n", shards, threads, total, elapsed,
+           elapsed > 0 ? total / elapsed : 0.0, failed ? "  (errors)" : "");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s dir [threads] [ops_per_thread]\n", argv[0]);
+        return 1;
+    }
+
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+    long ops = argc > 3 ? atol(argv[3]) : 20000;
+    if (threads < 1) threads = 1;
+
+    // Shard setup chatter goes to stdout; keep the table readable
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("  %6s %8s %10s %10s %12s\n", "shards", "threads", "ops", "seconds", "ops/s");
+
+    int counts[] = { 1, 2, 4, 8, 16 };
+    for (int i = 0; i < 5; i++) {
+        if (run_round(argv[1], counts[i], threads, ops) != 0) {
+            fprintf(stderr, "could not create %d shards in %s\n", counts[i], argv[1]);
+            return 1;
+        }
+    }
+    return 0;
+}
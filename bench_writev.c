@@ -0,0 +1,167 @@
+/* Scatter-gather record writes: each record is a header, a payload and a
+ * checksum in separate buffers. Appends them with one fs_write per buffer,
+ * one fs_writev per record and one fs_writev per batch of records, then
+ * reads them back the same ways.
+
+   usage: bench_writev [records] [records_per_batch]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "filesystem.h"
+
+#define IMAGE_SIZE (32 * 1024 * 1024)
+#define PARTS 3
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+    uint64_t stamp;
+} record_header;
+
+typedef struct {
+    record_header header;
+    char payload[40];
+    uint64_t checksum;
+} record;
+
+#define RECORD_SIZE ((int32_t)(sizeof(record_header) + 40 + sizeof(uint64_t)))
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_record(record *r, uint32_t id) {
+    r->header.id = id;
+    r->header.len = sizeof(r->payload);
+    r->header.stamp = id * 2654435761u;
+    memset(r->payload, 'a' + id % 26, sizeof(r->payload));
+    r->checksum = r->header.stamp ^ id;
+}
+
+static void record_iov(record *r, struct iovec *iov) {
+    iov[0] = (struct iovec){ &r->header, sizeof(r->header) };
+    iov[1] = (struct iovec){ r->payload, sizeof(r->payload) };
+    iov[2] = (struct iovec){ &r->checksum, sizeof(r->checksum) };
+}
+
+static file_handler fresh_file(int fd, const char *name) {
+    int idx = find_file_by_name(fd, name);
+    if (idx != -1) {
+        file_handler old = { idx, 0, 1 };
+        rm_file(fd, &old);
+    }
+    return open_file(fd, name, CREATE);
+}
+
+/* Append all records with `batch` records per call; batch 0 = one fs_write per buffer. */
+static double write_round(int fd, record *recs, long count, int batch) {
+    file_handler fh = fresh_file(fd, "records");
+    struct iovec iov[IOV_MAX];
+
+    double t0 = now_seconds();
+    for (long i = 0; i < count; ) {
+        int32_t pos = i * RECORD_SIZE;
+        if (batch == 0) {
+            record_iov(&recs[i], iov);
+            for (int p = 0; p < PARTS; p++) {
+                fs_write(fd, &fh, pos, iov[p].iov_base, iov[p].iov_len);
+                pos += iov[p].iov_len;
+            }
+            i++;
+            continue;
+        }
+        int k = 0;
+        for (; k < batch && i < count; k++, i++)
+            record_iov(&recs[i], iov + k * PARTS);
+        fs_writev(fd, &fh, pos, iov, k * PARTS);
+    }
+    return now_seconds() - t0;
+}
+
+static double read_round(int fd, record *back, long count, int batch) {
+    int idx = find_file_by_name(fd, "records");
+    file_handler fh = { idx, 0, 1 };
+    struct iovec iov[IOV_MAX];
+
+    double t0 = now_seconds();
+    for (long i = 0; i < count; ) {
+        int32_t pos = i * RECORD_SIZE;
+        if (batch == 0) {
+            record_iov(&back[i], iov);
+            for (int p = 0; p < PARTS; p++) {
+                fs_read(fd, &fh, pos, iov[p].iov_len, iov[p].iov_base);
+                pos += iov[p].iov_len;
+            }
+            i++;
+            continue;
+        }
+        int k = 0;
+        for (; k < batch && i < count; k++, i++)
+            record_iov(&back[i], iov + k * PARTS);
+        fs_readv(fd, &fh, pos, iov, k * PARTS);
+    }
+    return now_seconds() - t0;
+}
+
+static int same_records(const record *a, const record *b, long count) {
+    for (long i = 0; i < count; i++) {
+        if (memcmp(&a[i].header, &b[i].header, sizeof(a[i].header)) != 0 ||
+            memcmp(a[i].payload, b[i].payload, sizeof(a[i].payload)) != 0 ||
+            a[i].checksum != b[i].checksum)
+            return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    long count = argc > 1 ? atol(argv[1]) : 20000;
+    int per_batch = argc > 2 ? atoi(argv[2]) : 64;
+    if (count < 1) count = 1;
+    if (count * RECORD_SIZE > IMAGE_SIZE / 4) count = IMAGE_SIZE / 4 / RECORD_SIZE;
+    if (per_batch < 1) per_batch = 1;
+    if (per_batch > IOV_MAX / PARTS) per_batch = IOV_MAX / PARTS;
+
+    char path[] = "/tmp/bench_writevXXXXXX";
+    int tmp = mkstemp(path);
+    if (tmp == -1) {
+        perror("image");
+        return 1;
+    }
+    close(tmp);
+    int fd = initialize_filesystem(path, IMAGE_SIZE);
+    unlink(path);
+    if (fd == -1) return 1;
+
+    record *recs = calloc(count, sizeof(record));
+    record *back = calloc(count, sizeof(record));
+    if (!recs || !back) return 1;
+    for (long i = 0; i < count; i++) make_record(&recs[i], i);
+
+    const char *labels[] = { "write/buffer", "writev/record", "writev/batch" };
+    int batches[] = { 0, 1, per_batch };
+
+    printf("%-14s %10s %12s %12s %12s\n", "mode", "records", "write us/rec", "read us/rec", "check");
+    for (int m = 0; m < 3; m++) {
+        memset(back, 0, count * sizeof(record));
+        double w = write_round(fd, recs, count, batches[m]);
+        double r = read_round(fd, back, count, batches[m]);
+        printf("%-14s %10ld %12.3f %12.3f %12s\n", labels[m], count,
+               w / count * 1e6, r / count * 1e6, same_records(recs, back, count) ? "ok" : "MISMATCH");
+    }
+
+    free(recs);
+    free(back);
+    close(fd);
+    return 0;
+}
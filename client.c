@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "client.h"
+
+
+static int write_all(int sock, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = send(sock, p, len, MSG_NOSIGNAL);
+        if (w == -1 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+static int read_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t r = recv(sock, p, len, 0);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+int fsc_connect(fs_client *c, const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    c->next_id = 1;
+    c->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (c->sock == -1) return -1;
+
+    if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(c->sock);
+        c->sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void fsc_disconnect(fs_client *c) {
+    if (c->sock != -1) close(c->sock);
+    c->sock = -1;
+}
+
+int64_t fsc_send(fs_client *c, uint8_t op, uint8_t flags, const char *name,
+                 int32_t pos, const void *data, int32_t len) {
+    size_t name_len = strlen(name);
+    if (name_len > FSP_MAX_NAME || len < 0 || len > FSP_MAX_IO) return -1;
+
+    // Header, name and payload go out in one send
+    char frame[sizeof(fsp_request) + FSP_MAX_NAME + FSP_MAX_IO];
+    fsp_request *req = (fsp_request *)frame;
+    req->op = op;
+    req->flags = flags;
+    req->name_len = name_len;
+    req->id = c->next_id++;
+    req->pos = pos;
+    req->len = len;
+
+    size_t size = sizeof(*req);
+    memcpy(frame + size, name, name_len);
+    size += name_len;
+    if (op == FSP_WRITE && len > 0) {
+        memcpy(frame + size, data, len);
+        size += len;
+    }
+
+    if (write_all(c->sock, frame, size) != 0) return -1;
+    return req->id;
+}
+
+int fsc_recv(fs_client *c, fsp_response *resp, void *buf, int32_t cap) {
+    if (read_all(c->sock, resp, sizeof(*resp)) != 0) return -1;
+
+    int32_t keep = resp->len < cap ? resp->len : cap;
+    if (keep > 0 && read_all(c->sock, buf, keep) != 0) return -1;
+
+    // Drain whatever did not fit
+    char scratch[4096];
+    for (int32_t left = resp->len - keep; left > 0; ) {
+        int32_t chunk = left > (int32_t)sizeof(scratch) ? (int32_t)sizeof(scratch) : left;
+        if (read_all(c->sock, scratch, chunk) != 0) return -1;
+        left -= chunk;
+    }
+    return 0;
+}
+
+// Send one request and wait for its response
+static int call(fs_client *c, uint8_t op, uint8_t flags, const char *name, int32_t pos,
+                const void *data, int32_t len, void *out, int32_t cap) {
+    if (fsc_send(c, op, flags, name, pos, data, len) == -1) return -1;
+
+    fsp_response resp;
+    if (fsc_recv(c, &resp, out, cap) != 0) return -1;
+    return resp.status;
+}
+
+int fsc_open(fs_client *c, const char *name, int flags) {
+    return call(c, FSP_OPEN, (flags & CREATE) ? FSP_CREATE : 0, name, 0, NULL, 0, NULL, 0);
+}
+
+int fsc_read(fs_client *c, const char *name, int32_t pos, int32_t n, char *buffer) {
+    return call(c, FSP_READ, 0, name, pos, NULL, n, buffer, n);
+}
+
+int fsc_write(fs_client *c, const char *name, int32_t pos, const char *buffer, int32_t n) {
+    return call(c, FSP_WRITE, 0, name, pos, buffer, n, NULL, 0);
+}
+
+int fsc_rm(fs_client *c, const char *name) {
+    return call(c, FSP_RM, 0, name, 0, NULL, 0, NULL, 0);
+}
+
+int fsc_stat(fs_client *c, const char *name, file_metadata *meta) {
+    return call(c, FSP_STAT, 0, name, 0, NULL, 0, meta, sizeof(*meta));
+}
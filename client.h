@@ -0,0 +1,32 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+#include "filesystem.h"
+
+// Client library for the daemon (server.c). The fsc_open/read/write/rm/stat
+// calls are synchronous; fsc_send and fsc_recv let a caller pipeline
+// requests and collect the responses later.
+typedef struct {
+    int sock;
+    uint32_t next_id;
+} fs_client;
+
+int fsc_connect(fs_client *c, const char *socket_path);
+void fsc_disconnect(fs_client *c);
+
+// Returns the request id, or -1
+int64_t fsc_send(fs_client *c, uint8_t op, uint8_t flags, const char *name,
+                 int32_t pos, const void *data, int32_t len);
+// Reads one response; up to cap payload bytes go to buf, the rest is dropped
+int fsc_recv(fs_client *c, fsp_response *resp, void *buf, int32_t cap);
+
+int fsc_open(fs_client *c, const char *name, int flags);
+int fsc_read(fs_client *c, const char *name, int32_t pos, int32_t n, char *buffer);
+int fsc_write(fs_client *c, const char *name, int32_t pos, const char *buffer, int32_t n);
+int fsc_rm(fs_client *c, const char *name);
+int fsc_stat(fs_client *c, const char *name, file_metadata *meta);
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesystem.h"
+#include "extent_index.h"
+
+#define MAX_INDEXED_IMAGES 16
+#define EXTENT_BUCKETS 4096         // power of two, twice MAX_EXTENTS
+#define WORD_BITS 64
+
+typedef struct {
+    int fd;                                         // -1 = unused
+    int32_t start[MAX_EXTENTS];                     // -1 = empty slot
+    int bucket[EXTENT_BUCKETS];                     // first slot of each chain, -1 = none
+    int chain[MAX_EXTENTS];                         // next slot with the same hash
+    uint64_t extent_used[MAX_EXTENTS / WORD_BITS];
+    uint64_t segment_used[MAX_SEGMENTS / WORD_BITS];
+} extent_index;
+
+static extent_index *indexes[MAX_INDEXED_IMAGES];
+
+
+static unsigned bucket_of(int32_t start) {
+    return ((uint32_t)start * 2654435761u) >> 20;   // top 12 bits
+}
+
+static void set_bit(uint64_t *words, int i, int on) {
+    if (on) words[i / WORD_BITS] |= 1ull << (i % WORD_BITS);
+    else    words[i / WORD_BITS] &= ~(1ull << (i % WORD_BITS));
+}
+
+static int first_clear(const uint64_t *words, int nbits) {
+    for (int w = 0; w < nbits / WORD_BITS; w++) {
+        if (~words[w]) return w * WORD_BITS + __builtin_ctzll(~words[w]);
+    }
+    return -1;
+}
+
+static void unlink_extent(extent_index *ix, int i) {
+    int *link = &ix->bucket[bucket_of(ix->start[i])];
+    while (*link != i) link = &ix->chain[*link];
+    *link = ix->chain[i];
+}
+
+static void set_extent(extent_index *ix, int i, int32_t start) {
+    if (ix->start[i] != -1) unlink_extent(ix, i);
+
+    ix->start[i] = start;
+    set_bit(ix->extent_used, i, start != -1);
+    if (start == -1) return;
+
+    unsigned b = bucket_of(start);
+    ix->chain[i] = ix->bucket[b];
+    ix->bucket[b] = i;
+}
+
+/* Find the index for fd, building it from one read of the extent and
+ * segment tables the first time. NULL if it could not be built. */
+static extent_index *get_index(int fd) {
+    int free_slot = -1;
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i] && indexes[i]->fd == fd) return indexes[i];
+        if (!indexes[i] && free_slot == -1) free_slot = i;
+    }
+    if (free_slot == -1) return NULL;
+
+    size_t ext_size = sizeof(extent_ref) * MAX_EXTENTS;
+    size_t seg_size = sizeof(file_segment) * MAX_SEGMENTS;
+    extent_ref *exts = malloc(ext_size);
+    file_segment *segs = malloc(seg_size);
+    extent_index *ix = malloc(sizeof(*ix));
+    if (!exts || !segs || !ix ||
+        pread(fd, exts, ext_size, extent_ref_offset(0)) != (ssize_t)ext_size ||
+        pread(fd, segs, seg_size, segment_offset(0)) != (ssize_t)seg_size) {
+        free(exts);
+        free(segs);
+        free(ix);
+        return NULL;
+    }
+
+    memset(ix->extent_used, 0, sizeof(ix->extent_used));
+    memset(ix->segment_used, 0, sizeof(ix->segment_used));
+    memset(ix->bucket, -1, sizeof(ix->bucket));
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        ix->start[i] = -1;
+        set_extent(ix, i, exts[i].start);
+    }
+    for (int i = 0; i < MAX_SEGMENTS; i++)
+        set_bit(ix->segment_used, i, segs[i].start != -1);
+    free(exts);
+    free(segs);
+
+    ix->fd = fd;
+    indexes[free_slot] = ix;
+    return ix;
+}
+
+// Without a built index the update is dropped; the first query reads the tables
+static extent_index *built_index(int fd) {
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i] && indexes[i]->fd == fd) return indexes[i];
+    }
+    return NULL;
+}
+
+int extent_index_lookup(int fd, int32_t start) {
+    extent_index *ix = get_index(fd);
+    if (!ix) return EXTENT_INDEX_UNAVAILABLE;
+    if (start == -1) return -1;
+
+    for (int i = ix->bucket[bucket_of(start)]; i != -1; i = ix->chain[i]) {
+        if (ix->start[i] == start) return i;
+    }
+    return -1;
+}
+
+int extent_index_free_extent(int fd) {
+    extent_index *ix = get_index(fd);
+    if (!ix) return EXTENT_INDEX_UNAVAILABLE;
+    return first_clear(ix->extent_used, MAX_EXTENTS);
+}
+
+int extent_index_free_segment(int fd) {
+    extent_index *ix = get_index(fd);
+    if (!ix) return EXTENT_INDEX_UNAVAILABLE;
+    return first_clear(ix->segment_used, MAX_SEGMENTS);
+}
+
+void extent_index_set_extent(int fd, int index, int32_t start) {
+    extent_index *ix = built_index(fd);
+    if (!ix || index < 0 || index >= MAX_EXTENTS) return;
+    set_extent(ix, index, start);
+}
+
+void extent_index_set_segment(int fd, int index, int used) {
+    extent_index *ix = built_index(fd);
+    if (!ix || index < 0 || index >= MAX_SEGMENTS) return;
+    set_bit(ix->segment_used, index, used);
+}
+
+void extent_index_drop(int fd) {
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i] && indexes[i]->fd == fd) {
+            free(indexes[i]);
+            indexes[i] = NULL;
+        }
+    }
+}
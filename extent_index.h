@@ -0,0 +1,23 @@
+#ifndef EXTENT_INDEX_H
+#define EXTENT_INDEX_H
+
+#include <stdint.h>
+
+#include "filesystem.h"
+
+// In-memory index over the live extent and segment tables, built on first
+// use for each image fd from one read of each table. Extent starts are kept
+// in a hash table, so finding the slot of an extent no longer reads every
+// slot from disk, and a used bit per slot turns "first free slot" into a
+// scan of a few words. write_extent_ref and write_segment keep it up to date.
+
+#define EXTENT_INDEX_UNAVAILABLE -2   // lookup result: caller must scan itself
+
+int extent_index_lookup(int file_descriptor, int32_t start);
+int extent_index_free_extent(int file_descriptor);
+int extent_index_free_segment(int file_descriptor);
+void extent_index_set_extent(int file_descriptor, int index, int32_t start);
+void extent_index_set_segment(int file_descriptor, int index, int used);
+void extent_index_drop(int file_descriptor);
+
+#endif
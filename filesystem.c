@@ -3,13 +3,82 @@
    Keep the rest of your file API and behaviour unchanged.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "filesystem.h"
+#include "name_index.h"
+#include "attr_index.h"
+#include "extent_index.h"
+#include "writeback.h"
+
+// A mounted snapshot, one per image fd: read_metadata and read_segment look
+// at its frozen tables instead of the live ones, and writes are refused.
+// Per fd so that mounting on one volume shard leaves the others live.
+typedef struct {
+    int mounted;                    // entry in use; set last, cleared first
+    int fd;
+    int slot;                       // snapshot table slot
+    int32_t metadata_offset;        // frozen metadata table
+    int32_t segment_offset;         // frozen segment table
+} snapshot_mount_entry;
+
+#define MAX_MOUNTS 16
+static snapshot_mount_entry mounts[MAX_MOUNTS];
+
+// Bumped on every metadata or extent table change, so streaming handles can
+// tell when their cached view is stale without re-reading it per chunk.
+// Atomic because volume shards call in from several threads.
+static uint32_t fs_generation = 0;
+
+typedef struct {
+    file_handler fh;
+    int fd;
+    file_metadata meta;     // cached; refreshed after any slow-path write
+    file_segment seg;       // first segment, valid when dense
+    int dense;              // one segment covering [0, size): no holes to handle
+    int32_t capacity;       // room in the extent from seg.start, 0 if none
+    int exclusive;          // extent not shared, so it can be written in place
+    uint32_t generation;    // fs_generation the cache was resolved at
+
+    char rbuf[STREAM_BUFFER_SIZE];   // readahead window [rbuf_pos, rbuf_pos + rbuf_len)
+    int32_t rbuf_pos;
+    int32_t rbuf_len;
+
+    char *wbuf;                      // pending writes [wbuf_pos, wbuf_pos + wbuf_len)
+    int32_t wbuf_pos;
+    int32_t wbuf_len;
+    int32_t wbuf_cap;
+    int delayed;                     // DELAY_ALLOC: wbuf grows, allocation waits for flush
+    char wbuf_inline[STREAM_BUFFER_SIZE];
+} open_file_entry;
+
+static open_file_entry open_files[MAX_OPEN_FILES];
+// Guards claiming and releasing entries. An entry itself is only used under
+// its image's own lock, like the rest of the API.
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static int open_count = 0;          // entries in use, read without the lock
+
+
+static snapshot_mount_entry *mount_of(int fd) {
+    for (int i = 0; i < MAX_MOUNTS; i++) {
+        if (__atomic_load_n(&mounts[i].mounted, __ATOMIC_ACQUIRE) && mounts[i].fd == fd)
+            return &mounts[i];
+    }
+    return NULL;
+}
 
 
 int read_fs_header(int file_descriptor, file_system_header *header) {
@@ -22,24 +91,39 @@ int read_fs_header(int file_descriptor, file_system_header *header) {
 int write_fs_header(int file_descriptor, const file_system_header *header) {
     if (lseek(file_descriptor, 0, SEEK_SET) == -1) return -1;
     if (write(file_descriptor, header, sizeof(*header)) != sizeof(*header)) return -1;
+    writeback_note(file_descriptor, 0, sizeof(*header));
     return 0;
 }
 
 int read_metadata(int file_descriptor, int index, file_metadata *meta) {
-    off_t offset = sizeof(file_system_header) + index * sizeof(file_metadata);
+    snapshot_mount_entry *m = mount_of(file_descriptor);
+    off_t offset = (m ? m->metadata_offset : (off_t)sizeof(file_system_header))
+                 + index * sizeof(file_metadata);
     if (lseek(file_descriptor, offset, SEEK_SET) == -1) return -1;
     if (read(file_descriptor, meta, sizeof(*meta)) != sizeof(*meta)) return -1;
     return 0;
 }
 
 int write_metadata(int file_descriptor, int index, const file_metadata *meta) {
+    // Snapshots are read-only
+    if (mount_of(file_descriptor)) return -1;
+    __atomic_add_fetch(&fs_generation, 1, __ATOMIC_RELAXED);
     off_t offset = sizeof(file_system_header) + index * sizeof(file_metadata);
     if (lseek(file_descriptor, offset, SEEK_SET) == -1) return -1;
     if (write(file_descriptor, meta, sizeof(*meta)) != sizeof(*meta)) return -1;
+    writeback_note(file_descriptor, offset, sizeof(*meta));
+    name_index_update(file_descriptor, index, meta);
+    attr_index_update(file_descriptor, index, meta);
     return 0;
 }
 
 int find_file_by_name(int file_descriptor, const char *filename) {
+    // The in-memory index covers the live table only
+    if (!mount_of(file_descriptor)) {
+        int found = name_index_lookup(file_descriptor, filename);
+        if (found != NAME_INDEX_UNAVAILABLE) return found;
+    }
+
     file_metadata meta;
     int i;
     for (i = 0; i < MAX_FILES; i++) {
@@ -53,6 +137,11 @@ int find_file_by_name(int file_descriptor, const char *filename) {
 }
 
 int find_free_metadata_slot(int file_descriptor) {
+    if (!mount_of(file_descriptor)) {
+        int slot = name_index_free_slot(file_descriptor);
+        if (slot != NAME_INDEX_UNAVAILABLE) return slot;
+    }
+
     file_metadata meta;
     // Find last empty file
     int i;
@@ -137,126 +226,1144 @@ int close_file(file_handler *fh) {
 }
 
 
+// ---------------- Segment table and file data maps ----------------
+
+int read_segment(int file_descriptor, int index, file_segment *seg) {
+    snapshot_mount_entry *m = mount_of(file_descriptor);
+    off_t off = m ? m->segment_offset + (off_t)sizeof(file_segment) * index
+                  : segment_offset(index);
+    if (pread(file_descriptor, seg, sizeof(*seg), off) != sizeof(*seg)) return -1;
+    return 0;
+}
+
+int write_segment(int file_descriptor, int index, const file_segment *seg) {
+    if (mount_of(file_descriptor)) return -1;
+    __atomic_add_fetch(&fs_generation, 1, __ATOMIC_RELAXED);
+    if (pwrite(file_descriptor, seg, sizeof(*seg), segment_offset(index)) != sizeof(*seg)) return -1;
+    writeback_note(file_descriptor, segment_offset(index), sizeof(*seg));
+    extent_index_set_segment(file_descriptor, index, seg->start != -1);
+    return 0;
+}
+
+static int find_free_segment_slot(int fd) {
+    int slot = extent_index_free_segment(fd);
+    if (slot != EXTENT_INDEX_UNAVAILABLE) return slot;
+
+    file_segment seg;
+    for (int i = 0; i < MAX_SEGMENTS; i++) {
+        if (read_segment(fd, i, &seg) != 0) continue;
+        if (seg.start == -1) return i;
+    }
+    return -1;
+}
+
+/* A file's segment chain, loaded into memory so an operation can rewrite
+ * it freely and store it back with save_map(). */
+typedef struct {
+    file_segment seg;
+    int slot;            // segment table slot, -1 = not stored yet
+} seg_entry;
+
+typedef struct {
+    seg_entry e[MAX_FILE_SEGMENTS];
+    int count;
+    int dropped[MAX_FILE_SEGMENTS];   // stored slots to clear on save
+    int ndropped;
+} seg_map;
+
+static int32_t seg_end(const file_segment *seg) {
+    return seg->pos + seg->len;
+}
+
+static int load_map(int fd, const file_metadata *meta, seg_map *map) {
+    map->count = 0;
+    map->ndropped = 0;
+    for (int i = meta->next; i != -1; ) {
+        if (map->count == MAX_FILE_SEGMENTS) return -1;
+        seg_entry *ent = &map->e[map->count++];
+        if (read_segment(fd, i, &ent->seg) != 0) return -1;
+        ent->slot = i;
+        i = ent->seg.next;
+    }
+    return 0;
+}
+
+static void map_remove(seg_map *map, int k) {
+    if (map->e[k].slot != -1) map->dropped[map->ndropped++] = map->e[k].slot;
+    memmove(&map->e[k], &map->e[k + 1], sizeof(seg_entry) * (map->count - k - 1));
+    map->count--;
+}
+
+static int map_insert(seg_map *map, int k, const file_segment *seg) {
+    if (map->count == MAX_FILE_SEGMENTS) {
+        printf("Too many segments in file!\n");
+        return -1;
+    }
+    memmove(&map->e[k + 1], &map->e[k], sizeof(seg_entry) * (map->count - k));
+    map->e[k].seg = *seg;
+    map->e[k].slot = -1;
+    map->count++;
+    return 0;
+}
+
+/* Store the chain back and point meta at it; the caller writes meta.
+ * Written back to front so every record goes out with its final next link. */
+static int save_map(int fd, file_metadata *meta, seg_map *map) {
+    file_segment empty = { 0, -1, 0, 0, -1 };
+    for (int i = 0; i < map->ndropped; i++) {
+        if (write_segment(fd, map->dropped[i], &empty) != 0) return -1;
+    }
+    map->ndropped = 0;
+
+    int next = -1;
+    for (int k = map->count - 1; k >= 0; k--) {
+        seg_entry *ent = &map->e[k];
+        if (ent->slot == -1) {
+            ent->slot = find_free_segment_slot(fd);
+            if (ent->slot == -1) {
+                printf("Segment table FULL!\n");
+                return -1;
+            }
+        }
+        ent->seg.next = next;
+        if (write_segment(fd, ent->slot, &ent->seg) != 0) return -1;
+        next = ent->slot;
+    }
+
+    meta->next = next;
+    meta->data_offset = map->count ? map->e[0].seg.start : 0;
+    return 0;
+}
+
+static int segment_extent(int fd, const file_segment *seg, extent_ref *ext) {
+    int e = find_extent_ref(fd, seg->extent);
+    if (e == -1 || read_extent_ref(fd, e, ext) != 0) return -1;
+    return e;
+}
+
+/* Copy len bytes inside the image from src to dst. */
+static int copy_data(int fd, int32_t src, int32_t dst, int32_t len) {
+    char buf[4096];
+    while (len > 0) {
+        int32_t chunk = len > (int32_t)sizeof(buf) ? (int32_t)sizeof(buf) : len;
+        if (lseek(fd, src, SEEK_SET) == -1) return -1;
+        if (read(fd, buf, chunk) != chunk) return -1;
+        if (lseek(fd, dst, SEEK_SET) == -1) return -1;
+        if (write(fd, buf, chunk) != chunk) return -1;
+        writeback_note(fd, dst, chunk);
+        src += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int zero_data(int fd, int32_t dst, int32_t len) {
+    char zero[4096] = {0};
+    while (len > 0) {
+        int32_t chunk = len > (int32_t)sizeof(zero) ? (int32_t)sizeof(zero) : len;
+        if (pwrite(fd, zero, chunk, dst) != chunk) return -1;
+        writeback_note(fd, dst, chunk);
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Move a segment to a fresh extent of `size` bytes, copying its data. Used
+ * when the old extent is shared (copy-on-write) or too small for the write.
+ * The old extent keeps its data for whoever still holds it. */
+static int relocate_segment(int fd, file_segment *seg, int32_t size) {
+    int off = allocate_space(fd, size);
+    if (off == -1) return -1;
+
+    if (extent_register(fd, off, size) != 0) {
+        free_space(fd, off, size);
+        return -1;
+    }
+
+    if (seg->start != -1) {
+        if (seg->len > 0 && copy_data(fd, seg->start, off, seg->len) != 0) {
+            extent_release(fd, off);
+            return -1;
+        }
+        extent_release(fd, seg->extent);
+    }
+
+    seg->start = off;
+    seg->extent = off;
+    return 0;
+}
+
+/* Make sure the segment sits on an unshared extent with room for `size`
+ * bytes from its first byte. Growth is tried in place first; a move reserves
+ * twice the old room when it can, so segments grown by many small writes do
+ * not move each time. */
+static int ensure_capacity(int fd, file_segment *seg, int32_t size) {
+    if (size < seg->len) size = seg->len;
+    if (seg->start == -1)
+        return relocate_segment(fd, seg, size);
+
+    extent_ref ext;
+    int e = segment_extent(fd, seg, &ext);
+    if (e == -1) return -1;
+
+    int32_t room = ext.start + ext.size - seg->start;
+    if (ext.refs == 1 && size <= room) return 0;
+
+    // Shared with a snapshot, clone or another piece of this file: copy-on-write
+    if (ext.refs > 1)
+        return relocate_segment(fd, seg, size);
+
+    if (allocate_at(fd, ext.start + ext.size, size - room) != -1) {
+        ext.size += size - room;
+        return write_extent_ref(fd, e, &ext);
+    }
+
+    if (room * 2 > size && relocate_segment(fd, seg, room * 2) == 0) return 0;
+    return relocate_segment(fd, seg, size);
+}
+
+/* Bytes from the segment's start to the end of its extent, if the extent
+ * is the segment's alone and can be written in place; 0 otherwise. */
+static int32_t reserved_room(int fd, const file_segment *seg) {
+    if (seg->start == -1) return 0;
+    extent_ref ext;
+    if (segment_extent(fd, seg, &ext) == -1 || ext.refs != 1) return 0;
+    return ext.start + ext.size - seg->start;
+}
+
+/* Return the unused space behind the segment's last byte, if the extent is
+ * the segment's alone. */
+static int trim_tail(int fd, const file_segment *seg) {
+    extent_ref ext;
+    int e = segment_extent(fd, seg, &ext);
+    if (e == -1) return -1;
+    if (ext.refs != 1) return 0;
+
+    int32_t keep = seg->start + seg->len - ext.start;
+    if (keep == 0 || keep >= ext.size) return 0;
+    if (free_space(fd, ext.start + keep, ext.size - keep) != 0) return -1;
+    ext.size = keep;
+    return write_extent_ref(fd, e, &ext);
+}
+
+/* Drop the first `cut` bytes of a segment. When they are the front of an
+ * unshared extent, that space is freed and the extent re-keyed. */
+static int trim_head(int fd, file_segment *seg, int32_t cut) {
+    extent_ref ext;
+    int e = segment_extent(fd, seg, &ext);
+    if (e == -1) return -1;
+
+    if (ext.refs == 1 && seg->start == ext.start) {
+        if (free_space(fd, ext.start, cut) != 0) return -1;
+        ext.start += cut;
+        ext.size -= cut;
+        if (write_extent_ref(fd, e, &ext) != 0) return -1;
+        seg->extent = ext.start;
+    }
+
+    seg->pos += cut;
+    seg->start += cut;
+    seg->len -= cut;
+    return 0;
+}
+
+/* Cut [a, b) out of the middle of segment k, leaving two segments. An
+ * unshared extent is split too and the middle freed; a shared one stays
+ * whole and the right half takes a reference of its own. */
+static int split_segment(int fd, seg_map *map, int k, int32_t a, int32_t b) {
+    file_segment *seg = &map->e[k].seg;
+    file_segment right = *seg;
+    right.pos = b;
+    right.start = seg->start + (b - seg->pos);
+    right.len = seg_end(seg) - b;
+
+    extent_ref ext;
+    int e = segment_extent(fd, seg, &ext);
+    if (e == -1 || map->count == MAX_FILE_SEGMENTS) return -1;
+
+    if (ext.refs == 1) {
+        int32_t hole = seg->start + (a - seg->pos);
+        if (extent_register(fd, right.start, ext.start + ext.size - right.start) != 0) return -1;
+        ext.size = hole - ext.start;
+        if (write_extent_ref(fd, e, &ext) != 0) return -1;
+        if (free_space(fd, hole, right.start - hole) != 0) return -1;
+        right.extent = right.start;
+    } else if (extent_acquire(fd, seg->extent) != 0) {
+        return -1;
+    }
+
+    seg->len = a - seg->pos;
+    return map_insert(map, k + 1, &right);
+}
+
+/* Point out[] at bytes [skip, skip + len) of an iovec array; returns the count. */
+static int iov_slice(const struct iovec *iov, int iovcnt, int32_t skip, int32_t len, struct iovec *out) {
+    int m = 0;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if ((size_t)skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t take = iov[i].iov_len - skip;
+        if (take > (size_t)len) take = len;
+        out[m].iov_base = (char *)iov[i].iov_base + skip;
+        out[m].iov_len = take;
+        m++;
+        len -= take;
+        skip = 0;
+    }
+    return m;
+}
+
+/* Write the n bytes gathered in iov at pos into the map. The write lands in
+ * a single segment (the one it starts in or just after, or a new one past a
+ * hole) and segments it reaches are merged into it, so the data always goes
+ * out in one pwritev. */
+static int map_write(int fd, seg_map *map, int32_t pos, const struct iovec *iov, int iovcnt, int32_t n) {
+    int i = -1;
+    while (i + 1 < map->count && map->e[i + 1].seg.pos <= pos) i++;
+
+    // Space fs_fallocate reserved is filled in place however far past the
+    // data it lands; SPARSE_GAP only decides for space not yet reserved
+    int reserved = i != -1 && pos < map->e[i].seg.pos + reserved_room(fd, &map->e[i].seg);
+
+    int t;
+    int32_t fill_from = -1;
+    if (i != -1 && (pos <= seg_end(&map->e[i].seg) + SPARSE_GAP || reserved ||
+                    map->count == MAX_FILE_SEGMENTS)) {
+        t = i;
+        if (pos > seg_end(&map->e[i].seg)) fill_from = seg_end(&map->e[i].seg);
+    } else {
+        file_segment fresh = { pos, -1, 0, -1, -1 };
+        t = i + 1;
+        if (map_insert(map, t, &fresh) != 0) return -1;
+    }
+
+    int32_t end = pos + n;
+    int32_t new_end = end > seg_end(&map->e[t].seg) ? end : seg_end(&map->e[t].seg);
+    int last = t;
+    while (last + 1 < map->count && map->e[last + 1].seg.pos <= end) {
+        last++;
+        if (seg_end(&map->e[last].seg) > new_end) new_end = seg_end(&map->e[last].seg);
+    }
+
+    file_segment *seg = &map->e[t].seg;
+    if (ensure_capacity(fd, seg, new_end - seg->pos) != 0) {
+        printf("No free space!\n");
+        return -1;
+    }
+
+    if (fill_from != -1 && zero_data(fd, seg->start + (fill_from - seg->pos), pos - fill_from) != 0)
+        return -1;
+
+    // Keep the tails of merged segments that stick out past the write
+    while (last > t) {
+        file_segment *merged = &map->e[t + 1].seg;
+        if (seg_end(merged) > end &&
+            copy_data(fd, merged->start + (end - merged->pos), seg->start + (end - seg->pos),
+                      seg_end(merged) - end) != 0)
+            return -1;
+        if (extent_release(fd, merged->extent) != 0) return -1;
+        map_remove(map, t + 1);
+        last--;
+    }
+
+    seg->len = new_end - seg->pos;
+    if (pwritev(fd, iov, iovcnt, seg->start + (pos - seg->pos)) != n) return -1;
+    writeback_note(fd, seg->start + (pos - seg->pos), n);
+    return n;
+}
+
+/* Read [pos, pos + n) of a file of `size` bytes into iov, one preadv per
+ * segment; holes come back as zeros without touching the image. */
+static int map_read(int fd, const seg_map *map, int32_t size, int32_t pos,
+                    const struct iovec *iov, int iovcnt, int32_t n) {
+    if (pos >= size) return 0;
+    if (pos + n > size) n = size - pos;
+
+    struct iovec part[IOV_MAX];
+    int m = iov_slice(iov, iovcnt, 0, n, part);
+    for (int i = 0; i < m; i++) memset(part[i].iov_base, 0, part[i].iov_len);
+
+    for (int k = 0; k < map->count; k++) {
+        const file_segment *seg = &map->e[k].seg;
+        int32_t lo = seg->pos > pos ? seg->pos : pos;
+        int32_t hi = seg_end(seg) < pos + n ? seg_end(seg) : pos + n;
+        if (lo >= hi) continue;
+        m = iov_slice(iov, iovcnt, lo - pos, hi - lo, part);
+        if (preadv(fd, part, m, seg->start + (lo - seg->pos)) != hi - lo)
+            return -1;
+    }
+    return n;
+}
+
+/* Turn [a, b) into a hole, giving unshared space back to the free list. */
+static int map_punch(int fd, seg_map *map, int32_t a, int32_t b) {
+    int k = 0;
+    while (k < map->count) {
+        file_segment *seg = &map->e[k].seg;
+        int32_t p = seg->pos, q = seg_end(seg);
+
+        if (q <= a || p >= b) {
+            k++;
+        } else if (a <= p && b >= q) {
+            if (extent_release(fd, seg->extent) != 0) return -1;
+            map_remove(map, k);
+        } else if (a <= p) {
+            if (trim_head(fd, seg, b - p) != 0) return -1;
+            k++;
+        } else if (b >= q) {
+            seg->len = a - p;
+            if (trim_tail(fd, seg) != 0) return -1;
+            k++;
+        } else {
+            if (split_segment(fd, map, k, a, b) != 0) return -1;
+            k += 2;
+        }
+    }
+    return 0;
+}
+
+/* Drop everything at or past new_size. */
+static int map_truncate(int fd, seg_map *map, int32_t new_size) {
+    while (map->count > 0) {
+        file_segment *seg = &map->e[map->count - 1].seg;
+        if (seg->pos >= new_size) {
+            if (extent_release(fd, seg->extent) != 0) return -1;
+            map_remove(map, map->count - 1);
+            continue;
+        }
+        if (seg_end(seg) > new_size) {
+            seg->len = new_size - seg->pos;
+            if (trim_tail(fd, seg) != 0) return -1;
+        }
+        break;
+    }
+    return 0;
+}
+
+
+// ---------------- Streaming handles ----------------
+
+static open_file_entry *get_open_file(int handle) {
+    if (handle < 0 || handle >= MAX_OPEN_FILES) return NULL;
+    if (!open_files[handle].fh.is_open) return NULL;
+    return &open_files[handle];
+}
+
+/* Re-resolve metadata and extent; only needed when the file may have moved. */
+static int refresh_open_file(open_file_entry *of) {
+    if (read_metadata(of->fd, of->fh.metadata_index, &of->meta) != 0) return -1;
+
+    of->generation = fs_generation;
+    of->rbuf_len = 0;
+    of->dense = 0;
+    of->capacity = 0;
+    of->exclusive = 0;
+    if (of->meta.next == -1) return 0;
+
+    if (read_segment(of->fd, of->meta.next, &of->seg) != 0) return -1;
+    if (of->seg.pos == 0 && of->seg.len == of->meta.size && of->seg.next == -1) {
+        extent_ref ext;
+        if (segment_extent(of->fd, &of->seg, &ext) == -1) return -1;
+        of->dense = 1;
+        of->capacity = ext.start + ext.size - of->seg.start;
+        of->exclusive = (ext.refs == 1);
+    }
+    return 0;
+}
+
+static int sync_open_file(open_file_entry *of) {
+    if (of->generation == fs_generation) return 0;
+    return refresh_open_file(of);
+}
+
+static int write_vector(int fd, file_handler *fh, int32_t pos, const struct iovec *iov, int iovcnt);
+
+/* Write straight into the cached extent when the file is dense, the extent
+ * is ours and big enough, and the write leaves no gap; otherwise let
+ * fs_write allocate, grow or copy-on-write, then re-resolve. */
+static int write_through(open_file_entry *of, int32_t pos, const char *buffer, int32_t n) {
+    if (sync_open_file(of) != 0) return -1;
+
+    if (!mount_of(of->fd) && of->dense && of->exclusive &&
+        pos <= of->meta.size && pos + n <= of->capacity) {
+        if (pwrite(of->fd, buffer, n, of->seg.start + pos) != n) return -1;
+        writeback_note(of->fd, of->seg.start + pos, n);
+        if (pos + n > of->meta.size) {
+            of->seg.len = pos + n;
+            of->meta.size = pos + n;
+            if (write_segment(of->fd, of->meta.next, &of->seg) != 0) return -1;
+            if (write_metadata(of->fd, of->fh.metadata_index, &of->meta) != 0) return -1;
+            of->generation = fs_generation;   // our own update, cache is current
+        }
+        return 0;
+    }
+
+    struct iovec iov = { (char *)buffer, n };
+    if (write_vector(of->fd, &of->fh, pos, &iov, 1) != n) return -1;
+    return refresh_open_file(of);
+}
+
+/* The buffer is only dropped once it is written: stream_write already
+ * reported those bytes, so a failed flush leaves them pending for a retry. */
+static int flush_open_file(open_file_entry *of) {
+    if (of->wbuf_len == 0) return 0;
+    int32_t n = of->wbuf_len;
+
+    // Delayed allocation: the final size is known now, so reserve it in one go
+    // when the buffer continues the first segment from 0. fs_fallocate always
+    // reserves from 0; past a hole the write allocates just what it covers.
+    if (of->delayed) {
+        if (sync_open_file(of) != 0) return -1;
+        int continues = of->meta.next == -1 ? of->wbuf_pos == 0
+                                            : of->dense && of->wbuf_pos <= of->meta.size;
+        if (continues && fs_fallocate(of->fd, &of->fh, of->wbuf_pos + n) != 0) return -1;
+    }
+
+    if (write_through(of, of->wbuf_pos, of->wbuf, n) != 0) return -1;
+    of->wbuf_len = 0;
+    return 0;
+}
+
+/* Land the pending stream writes on a file (index -1: on the whole image)
+ * before another path reads or changes it, so the two stay in order. */
+static int flush_streams(int fd, int index) {
+    if (__atomic_load_n(&open_count, __ATOMIC_ACQUIRE) == 0) return 0;
+
+    // Collect under the lock, flush outside it: other images need not wait
+    int found[MAX_OPEN_FILES], count = 0;
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_file_entry *of = &open_files[i];
+        if (!of->fh.is_open || of->fd != fd) continue;
+        if (index != -1 && of->fh.metadata_index != index) continue;
+        found[count++] = i;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+
+    int rc = 0;
+    for (int k = 0; k < count; k++) {
+        if (flush_open_file(&open_files[found[k]]) != 0) rc = -1;
+    }
+    return rc;
+}
+
+/* Make room for n more pending bytes; only delayed handles grow past the
+ * inline buffer. Returns -1 if the caller has to flush first. */
+static int reserve_wbuf(open_file_entry *of, int32_t n) {
+    if (of->wbuf_len + n <= of->wbuf_cap) return 0;
+    if (!of->delayed) return -1;
+
+    int32_t cap = of->wbuf_cap;
+    while (cap < of->wbuf_len + n) cap *= 2;
+
+    char *grown = (of->wbuf == of->wbuf_inline) ? malloc(cap) : realloc(of->wbuf, cap);
+    if (!grown) return -1;
+    if (of->wbuf == of->wbuf_inline) memcpy(grown, of->wbuf_inline, of->wbuf_len);
+
+    of->wbuf = grown;
+    of->wbuf_cap = cap;
+    return 0;
+}
+
+static void release_open_file(open_file_entry *of) {
+    pthread_mutex_lock(&open_files_lock);
+    of->fh.is_open = 0;
+    __atomic_sub_fetch(&open_count, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&open_files_lock);
+}
+
+int stream_open(int file_descriptor, const char *filename, int flags) {
+    file_handler fh = open_file(file_descriptor, filename, flags);
+    if (!fh.is_open) return -1;
+
+    int handle = -1;
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (!open_files[i].fh.is_open) { handle = i; break; }
+    }
+    if (handle == -1) {
+        pthread_mutex_unlock(&open_files_lock);
+        printf("Error: too many open files.\n");
+        return -1;
+    }
+
+    open_file_entry *of = &open_files[handle];
+    memset(of, 0, sizeof(*of));
+    of->fh = fh;
+    of->fd = file_descriptor;
+    of->wbuf = of->wbuf_inline;
+    of->wbuf_cap = STREAM_BUFFER_SIZE;
+    of->delayed = (flags & DELAY_ALLOC) != 0;
+    __atomic_add_fetch(&open_count, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&open_files_lock);
+
+    if (refresh_open_file(of) != 0) {
+        release_open_file(of);
+        return -1;
+    }
+    return handle;
+}
+
+// Returns the handle already open on a metadata slot, or -1.
+int stream_find(int file_descriptor, int metadata_index) {
+    int handle = -1;
+    pthread_mutex_lock(&open_files_lock);
+    for (int i = 0; i < MAX_OPEN_FILES && handle == -1; i++) {
+        if (open_files[i].fh.is_open && open_files[i].fd == file_descriptor &&
+            open_files[i].fh.metadata_index == metadata_index)
+            handle = i;
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return handle;
+}
+
+int stream_flush(int handle) {
+    open_file_entry *of = get_open_file(handle);
+    if (!of) return -1;
+    return flush_open_file(of);
+}
+
+int stream_close(int handle) {
+    open_file_entry *of = get_open_file(handle);
+    if (!of) return -1;
+
+    // Keep the handle, and its pending data, if they cannot be written yet
+    if (flush_open_file(of) != 0) {
+        printf("Error: pending writes of handle %d could not be written.\n", handle);
+        return -1;
+    }
+    if (of->wbuf != of->wbuf_inline) free(of->wbuf);
+    of->wbuf = of->wbuf_inline;
+    release_open_file(of);
+    return 0;
+}
+
+// Dense files are read straight from the extent; others go through the map
+static ssize_t read_at(open_file_entry *of, char *buffer, int32_t n, int32_t at) {
+    if (of->dense) return pread(of->fd, buffer, n, of->seg.start + at);
+    return fs_read(of->fd, &of->fh, at, n, buffer);
+}
+
+int stream_read(int handle, char *buffer, int32_t n) {
+    open_file_entry *of = get_open_file(handle);
+    if (!of || n < 0) return -1;
+
+    // Pending writes must land before they can be read back
+    if (flush_open_file(of) != 0) return -1;
+    if (sync_open_file(of) != 0) return -1;
+
+    int32_t pos = of->fh.pos;
+    if (pos >= of->meta.size) return 0;
+    if (pos + n > of->meta.size)
+        n = of->meta.size - pos;
+
+    int32_t done = 0;
+    while (done < n) {
+        int32_t at = pos + done;
+
+        // Serve from the readahead window when possible
+        if (at >= of->rbuf_pos && at < of->rbuf_pos + of->rbuf_len) {
+            int32_t chunk = of->rbuf_pos + of->rbuf_len - at;
+            if (chunk > n - done) chunk = n - done;
+            memcpy(buffer + done, of->rbuf + (at - of->rbuf_pos), chunk);
+            done += chunk;
+            continue;
+        }
+
+        // Large remainders bypass the window
+        if (n - done >= STREAM_BUFFER_SIZE) {
+            ssize_t r = read_at(of, buffer + done, n - done, at);
+            if (r <= 0) break;
+            done += r;
+            continue;
+        }
+
+        int32_t fill = of->meta.size - at;
+        if (fill > STREAM_BUFFER_SIZE) fill = STREAM_BUFFER_SIZE;
+        ssize_t r = read_at(of, of->rbuf, fill, at);
+        if (r <= 0) break;
+        of->rbuf_pos = at;
+        of->rbuf_len = r;
+    }
+
+    of->fh.pos += done;
+    return done;
+}
+
+int stream_write(int handle, const char *buffer, int32_t n) {
+    open_file_entry *of = get_open_file(handle);
+    if (!of || n < 0) return -1;
+
+    of->rbuf_len = 0;
+
+    // Coalesce only contiguous writes that still fit in the buffer
+    if (of->wbuf_len > 0 &&
+        (of->fh.pos != of->wbuf_pos + of->wbuf_len || reserve_wbuf(of, n) != 0)) {
+        if (flush_open_file(of) != 0) return -1;
+    }
+
+    if (!of->delayed && n >= STREAM_BUFFER_SIZE) {
+        if (write_through(of, of->fh.pos, buffer, n) != 0) return -1;
+    } else {
+        if (reserve_wbuf(of, n) != 0) return -1;
+        if (of->wbuf_len == 0) of->wbuf_pos = of->fh.pos;
+        memcpy(of->wbuf + of->wbuf_len, buffer, n);
+        of->wbuf_len += n;
+    }
+
+    of->fh.pos += n;
+    return n;
+}
+
+int32_t stream_seek(int handle, int32_t offset, int whence) {
+    open_file_entry *of = get_open_file(handle);
+    if (!of) return -1;
+
+    int32_t base;
+    if (whence == SEEK_SET) base = 0;
+    else if (whence == SEEK_CUR) base = of->fh.pos;
+    else if (whence == SEEK_END) {
+        if (sync_open_file(of) != 0) return -1;
+        base = of->meta.size;
+        if (of->wbuf_len > 0 && of->wbuf_pos + of->wbuf_len > base)
+            base = of->wbuf_pos + of->wbuf_len;
+    }
+    else return -1;
+
+    if (base + offset < 0) return -1;
+    of->fh.pos = base + offset;
+    return of->fh.pos;
+}
+
+
+/* Durability barrier: pending stream writes on the image are flushed, then
+ * everything written so far is synced, whatever the flusher is doing. */
+int fs_sync(int file_descriptor) {
+    int rc = flush_streams(file_descriptor, -1);
+    if (writeback_sync(file_descriptor) != 0) rc = -1;
+    return rc;
+}
+
+
 int fs_read(int file_descriptor, file_handler *fh, int32_t pos, int32_t n, char *buffer) {
+    struct iovec iov = { buffer, n };
+    return fs_readv(file_descriptor, fh, pos, &iov, 1);
+}
+
+int fs_write(int file_descriptor, file_handler *fh, int32_t pos, const char *buffer, int32_t n) {
+    struct iovec iov = { (char *)buffer, n };
+    return fs_writev(file_descriptor, fh, pos, &iov, 1);
+}
+
+// Total length of an iovec array, -1 if it is unusable
+static int32_t iov_total(const struct iovec *iov, int iovcnt) {
+    if (iovcnt < 0 || iovcnt > IOV_MAX) return -1;
+    int64_t n = 0;
+    for (int i = 0; i < iovcnt; i++) n += iov[i].iov_len;
+    return n > INT32_MAX ? -1 : (int32_t)n;
+}
+
+/* Scatter read: fills the buffers in order from pos, like preadv. */
+int fs_readv(int file_descriptor, file_handler *fh, int32_t pos, const struct iovec *iov, int iovcnt) {
     // If file is not is_open, you can't read it
-    if (!fh->is_open) return -1;
+    if (!fh->is_open || pos < 0) return -1;
+
+    int32_t n = iov_total(iov, iovcnt);
+    if (n < 0) return -1;
+    // A mounted snapshot is read-only; its streams were flushed at mount
+    if (!mount_of(file_descriptor) && flush_streams(file_descriptor, fh->metadata_index) != 0)
+        return -1;
 
     file_metadata meta;
     if (read_metadata(file_descriptor, fh->metadata_index, &meta) != 0) return -1;
 
-    // If pos is out of file's size,invalid
-    if (pos >= meta.size) return 0;
-
-    // If the read data is out of file's size, read until the end of file
-    if (pos + n > meta.size)
-        n = meta.size - pos;
-
-    off_t offset = meta.data_offset + pos;
+    seg_map map;
+    if (load_map(file_descriptor, &meta, &map) != 0) return -1;
 
-    if (lseek(file_descriptor, offset, SEEK_SET) == -1) return -1;
-    return read(file_descriptor, buffer, n);
+    return map_read(file_descriptor, &map, meta.size, pos, iov, iovcnt, n);
 }
 
- 
 
-int fs_write(int file_descriptor, file_handler *fh, int32_t pos, const char *buffer, int32_t n) {
+/* Gather write: the buffers land back to back from pos, like pwritev. The
+ * metadata is read and written once for the whole call. */
+int fs_writev(int file_descriptor, file_handler *fh, int32_t pos, const struct iovec *iov, int iovcnt) {
     if (!fh->is_open) return -1;
+    if (flush_streams(file_descriptor, fh->metadata_index) != 0) return -1;
+    return write_vector(file_descriptor, fh, pos, iov, iovcnt);
+}
 
-    file_system_header header;
-    if (read_fs_header(file_descriptor, &header) != 0) return -1;
+// fs_writev without the stream flush; what a handle's own flush goes through
+static int write_vector(int file_descriptor, file_handler *fh, int32_t pos, const struct iovec *iov, int iovcnt) {
+    if (!fh->is_open || pos < 0) return -1;
+    if (mount_of(file_descriptor)) return -1;
+
+    int32_t n = iov_total(iov, iovcnt);
+    if (n < 0 || pos > INT32_MAX - n) return -1;
+    if (n == 0) return 0;
 
     file_metadata meta;
     if (read_metadata(file_descriptor, fh->metadata_index, &meta) != 0) return -1;
 
-    if (meta.data_offset == 0) {
-        int off = allocate_space(file_descriptor, n);
-        if (off == -1) {
-            printf("No free space!\n");
-            return -1;
-        }
-        meta.data_offset = off;
-    }
+    seg_map map;
+    if (load_map(file_descriptor, &meta, &map) != 0) return -1;
+
+    if (map_write(file_descriptor, &map, pos, iov, iovcnt, n) != n) return -1;
+    if (save_map(file_descriptor, &meta, &map) != 0) return -1;
 
     // Extend file size if needed
     if (pos + n > meta.size)
         meta.size = pos + n;
 
-    // Write new metadata + new header
     if (write_metadata(file_descriptor, fh->metadata_index, &meta) != 0) return -1;
-    if (write_fs_header(file_descriptor, &header) != 0) return -1;
+    return n;
+}
 
-    // Write data
-    off_t offset = meta.data_offset + pos;
-    if (lseek(file_descriptor, offset, SEEK_SET) == -1) return -1;
 
-    return write(file_descriptor, buffer, n);
+/* Reserve a contiguous extent of `size` bytes from the start of the file
+ * ahead of the writes that will fill it. The file size is unchanged; only
+ * the allocation grows. */
+int fs_fallocate(int file_descriptor, file_handler *fh, int32_t size) {
+    if (!fh->is_open || size <= 0) return -1;
+    if (mount_of(file_descriptor)) return -1;
+
+    file_metadata meta;
+    if (read_metadata(file_descriptor, fh->metadata_index, &meta) != 0) return -1;
+
+    seg_map map;
+    if (load_map(file_descriptor, &meta, &map) != 0) return -1;
+
+    if (map.count == 0 || map.e[0].seg.pos != 0) {
+        file_segment fresh = { 0, -1, 0, -1, -1 };
+        if (map_insert(&map, 0, &fresh) != 0) return -1;
+    }
+
+    if (ensure_capacity(file_descriptor, &map.e[0].seg, size) != 0) {
+        printf("No free space!\n");
+        return -1;
+    }
+
+    if (save_map(file_descriptor, &meta, &map) != 0) return -1;
+    return write_metadata(file_descriptor, fh->metadata_index, &meta);
+}
+
+
+/* Deallocate [pos, pos + len): it reads back as zeros and its space is
+ * returned to the free list unless a snapshot or clone still shares it.
+ * The file size is unchanged. */
+int fs_punch_hole(int fd, file_handler *fh, int32_t pos, int32_t len) {
+    if (!fh->is_open || pos < 0 || len <= 0) return -1;
+    if (mount_of(fd)) return -1;
+    if (flush_streams(fd, fh->metadata_index) != 0) return -1;
+
+    file_metadata meta;
+    if (read_metadata(fd, fh->metadata_index, &meta) != 0) return -1;
+
+    seg_map map;
+    if (load_map(fd, &meta, &map) != 0) return -1;
+
+    if (map_punch(fd, &map, pos, pos + len) != 0) return -1;
+    if (save_map(fd, &meta, &map) != 0) return -1;
+    return write_metadata(fd, fh->metadata_index, &meta);
 }
 
 
 int shrink_file(int fd, file_handler *fh, int32_t new_size) {
     if (!fh->is_open) return -1;
+    if (mount_of(fd)) return -1;
+    if (flush_streams(fd, fh->metadata_index) != 0) return -1;
 
     file_metadata meta;
     if (read_metadata(fd, fh->metadata_index, &meta) != 0) return -1;
 
     if (new_size < 0 || new_size > meta.size) return -1;
 
-    if (new_size < meta.size) {
-        int freed_start = meta.data_offset + new_size;
-        int freed_size  = meta.size - new_size;
+    if (new_size < meta.size) {
+        seg_map map;
+        if (load_map(fd, &meta, &map) != 0) return -1;
+
+        // A shared extent is left intact: the snapshot still needs the tail
+        if (map_truncate(fd, &map, new_size) != 0) return -1;
+        if (save_map(fd, &meta, &map) != 0) return -1;
+    }
+
+    meta.size = new_size;
+    return write_metadata(fd, fh->metadata_index, &meta);
+}
+
+
+int fs_set_type(int fd, file_handler *fh, int32_t type) {
+    if (!fh->is_open) return -1;
+
+    file_metadata meta;
+    if (read_metadata(fd, fh->metadata_index, &meta) != 0) return -1;
+    meta.type = type;
+    return write_metadata(fd, fh->metadata_index, &meta);
+}
+
+// The owner lives in the high 16 bits of permission; the mode bits are kept
+int fs_set_owner(int fd, file_handler *fh, int32_t owner) {
+    if (!fh->is_open || owner < 0 || owner > 0xFFFF) return -1;
+
+    file_metadata meta;
+    if (read_metadata(fd, fh->metadata_index, &meta) != 0) return -1;
+    meta.permission = (int32_t)(((uint32_t)owner << 16) | ((uint32_t)meta.permission & 0xFFFF));
+    return write_metadata(fd, fh->metadata_index, &meta);
+}
+
+
+
+int rm_file(int file_descriptor, file_handler *fh) {
+    if (!fh->is_open) return -1;
+    if (mount_of(file_descriptor)) return -1;
+
+    file_metadata meta;
+    if (read_metadata(file_descriptor, fh->metadata_index, &meta) != 0) return -1;
+
+    // drop our references to the data; extents are freed once unshared
+    seg_map map;
+    if (load_map(file_descriptor, &meta, &map) != 0) return -1;
+    if (map_truncate(file_descriptor, &map, 0) != 0) return -1;
+    if (save_map(file_descriptor, &meta, &map) != 0) return -1;
+
+    // Zero metadata
+    file_metadata empty;
+    memset(&empty, 0, sizeof(empty));
+    if (write_metadata(file_descriptor, fh->metadata_index, &empty) != 0) return -1;
+
+    // Update FS header
+    file_system_header header;
+    if (read_fs_header(file_descriptor, &header) != 0) return -1;
+    header.files_count--;
+    if (write_fs_header(file_descriptor, &header) != 0) return -1;
+
+    fh->is_open = 0;
+    return 0;
+}
+
+
+
+/* Take back a clone that failed halfway: clear the segment slots save_map
+ * already stored, drop the references taken and remove the new entry. */
+static void undo_clone(int fd, file_handler *fh, const seg_map *map, int acquired) {
+    file_segment empty = { 0, -1, 0, 0, -1 };
+    for (int k = 0; k < map->count; k++) {
+        if (map->e[k].slot != -1) write_segment(fd, map->e[k].slot, &empty);
+    }
+    for (int k = 0; k < acquired; k++) extent_release(fd, map->e[k].seg.extent);
+
+    // The entry is still the empty one open_file created
+    rm_file(fd, fh);
+}
+
+/* Reflink-style clone: dst shares src's extents until either is written. */
+int fs_clone(int file_descriptor, const char *src, const char *dst) {
+    if (mount_of(file_descriptor)) return -1;
+
+    int src_index = find_file_by_name(file_descriptor, src);
+    if (src_index == -1) return -1;
+    if (flush_streams(file_descriptor, src_index) != 0) return -1;
+    if (find_file_by_name(file_descriptor, dst) != -1) {
+        printf("Error: file '%s' already exists.\n", dst);
+        return -1;
+    }
+
+    file_metadata meta;
+    if (read_metadata(file_descriptor, src_index, &meta) != 0) return -1;
+
+    seg_map map;
+    if (load_map(file_descriptor, &meta, &map) != 0) return -1;
+
+    file_handler fh = open_file(file_descriptor, dst, CREATE);
+    if (!fh.is_open) return -1;
+
+    // The clone gets its own chain, pointing at the same extents
+    for (int k = 0; k < map.count; k++) map.e[k].slot = -1;
+    int acquired = 0;
+    while (acquired < map.count &&
+           extent_acquire(file_descriptor, map.e[acquired].seg.extent) == 0)
+        acquired++;
+
+    memset(meta.name, 0, sizeof(meta.name));
+    strncpy(meta.name, dst, sizeof(meta.name)-1);
+    if (acquired < map.count || save_map(file_descriptor, &meta, &map) != 0 ||
+        write_metadata(file_descriptor, fh.metadata_index, &meta) != 0) {
+        undo_clone(file_descriptor, &fh, &map, acquired);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Move len bytes between two fds entirely in the kernel. copy_file_range
+ * first; sendfile when the kernel or filesystem pair does not support it. */
+static int transfer_range(int in_fd, off_t in_off, int out_fd, off_t out_off, int32_t len) {
+    int use_sendfile = 0;
+
+    while (len > 0) {
+        ssize_t r;
+        if (!use_sendfile) {
+            r = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+            if (r == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_sendfile = 1;
+                continue;
+            }
+        } else {
+            if (lseek(out_fd, out_off, SEEK_SET) == -1) return -1;
+            r = sendfile(out_fd, in_fd, &in_off, len);
+            if (r > 0) out_off += r;
+        }
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        len -= r;
+    }
+    return 0;
+}
+
+
+/* Point fh at the single extent [off, off + size) (off -1: empty) in place
+ * of its old contents, whose references are dropped. */
+static int replace_contents(int fd, file_handler *fh, int32_t off, int32_t size) {
+    if (flush_streams(fd, fh->metadata_index) != 0) return -1;
+
+    file_metadata meta;
+    if (read_metadata(fd, fh->metadata_index, &meta) != 0) return -1;
+    seg_map map;
+    if (load_map(fd, &meta, &map) != 0) return -1;
+
+    // Dropping the old chain frees a slot; without one, check before dropping it
+    if (off != -1 && map.count == 0 && find_free_segment_slot(fd) == -1) {
+        printf("Segment table FULL!\n");
+        return -1;
+    }
+
+    if (map_truncate(fd, &map, 0) != 0) return -1;
+    if (off != -1) {
+        file_segment seg = { 0, off, size, off, -1 };
+        if (map_insert(&map, 0, &seg) != 0) return -1;
+    }
+    if (save_map(fd, &meta, &map) != 0) return -1;
+
+    meta.size = size;
+    return write_metadata(fd, fh->metadata_index, &meta);
+}
+
+/* Import a whole host file, replacing `filename` if it exists. The extent is
+ * allocated up front in one piece and filled by transfer_range before the
+ * file is touched, so a failed import leaves an existing file as it was
+ * and does not leave a new one behind. */
+int fs_import(int file_descriptor, const char *host_path, const char *filename) {
+    if (mount_of(file_descriptor)) return -1;
+
+    int host_fd = open(host_path, O_RDONLY);
+    if (host_fd == -1) {
+        perror(host_path);
+        return -1;
+    }
 
-        if (free_space(fd, freed_start, freed_size) != 0) return -1;
+    struct stat st;
+    if (fstat(host_fd, &st) != 0 || st.st_size > INT32_MAX) {
+        close(host_fd);
+        return -1;
     }
+    int32_t size = st.st_size;
 
-    meta.size = new_size;
-    return write_metadata(fd, fh->metadata_index, &meta);
+    int off = -1;
+    if (size > 0) {
+        off = allocate_space(file_descriptor, size);
+        if (off == -1) {
+            printf("No free space!\n");
+            close(host_fd);
+            return -1;
+        }
+        if (extent_register(file_descriptor, off, size) != 0) {
+            free_space(file_descriptor, off, size);
+            close(host_fd);
+            return -1;
+        }
+        if (transfer_range(host_fd, 0, file_descriptor, off, size) != 0) {
+            extent_release(file_descriptor, off);
+            close(host_fd);
+            return -1;
+        }
+        writeback_note(file_descriptor, off, size);
+    }
+    close(host_fd);
+
+    // The data is in place; now swap it in for the old contents
+    int existed = find_file_by_name(file_descriptor, filename) != -1;
+    file_handler fh = open_file(file_descriptor, filename, CREATE);
+    if (!fh.is_open || replace_contents(file_descriptor, &fh, off, size) != 0) {
+        if (off != -1) extent_release(file_descriptor, off);
+        if (fh.is_open && !existed) rm_file(file_descriptor, &fh);
+        return -1;
+    }
+    return size;
 }
 
 
-
-int rm_file(int file_descriptor, file_handler *fh) {
-    if (!fh->is_open) return -1;
+int fs_export(int file_descriptor, const char *filename, const char *host_path) {
+    int index = find_file_by_name(file_descriptor, filename);
+    if (index == -1) return -1;
+    if (!mount_of(file_descriptor) && flush_streams(file_descriptor, index) != 0) return -1;
 
     file_metadata meta;
-    if (read_metadata(file_descriptor, fh->metadata_index, &meta) != 0) return -1;
+    if (read_metadata(file_descriptor, index, &meta) != 0) return -1;
 
-    // free the data block
-    if (meta.data_offset != 0 && meta.size > 0) {
-        if (free_space(file_descriptor, meta.data_offset, meta.size) != 0)
-            return -1;
-    }
+    seg_map map;
+    if (load_map(file_descriptor, &meta, &map) != 0) return -1;
 
-    // Zero metadata
-    file_metadata empty;
-    memset(&empty, 0, sizeof(empty));
-    if (write_metadata(file_descriptor, fh->metadata_index, &empty) != 0) return -1;
+    int host_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (host_fd == -1) {
+        perror(host_path);
+        return -1;
+    }
 
-    // Update FS header
-    file_system_header header;
-    if (read_fs_header(file_descriptor, &header) != 0) return -1;
-    header.files_count--;
-    if (write_fs_header(file_descriptor, &header) != 0) return -1;
+    // Holes are left unwritten, so they stay holes in the host file too
+    int rc = ftruncate(host_fd, meta.size);
+    for (int k = 0; k < map.count && rc == 0; k++) {
+        const file_segment *seg = &map.e[k].seg;
+        if (seg->len > 0)
+            rc = transfer_range(file_descriptor, seg->start, host_fd, seg->pos, seg->len);
+    }
 
-    fh->is_open = 0;
-    return 0;
+    close(host_fd);
+    return rc == 0 ? meta.size : -1;
 }
 
 
-
-int get_file_stats(int file_descriptor, file_handler *fh) {
+int get_file_stats(int file_descriptor, file_handler *fh, FILE *out) {
     if (!fh->is_open) return -1;
 
     file_metadata meta;
     if (read_metadata(file_descriptor, fh->metadata_index, &meta) != 0) return -1;
 
-    printf("File Stats:\n");
-    printf("Name: %s\n", meta.name);
-    printf("Size: %d\n", meta.size);
-    printf("Data Offset: %d\n", meta.data_offset);
+    fprintf(out, "File Stats:\n");
+    fprintf(out, "Name: %s\n", meta.name);
+    fprintf(out, "Size: %d\n", meta.size);
+    fprintf(out, "Data Offset: %d\n", meta.data_offset);
+
+    seg_map map;
+    if (load_map(file_descriptor, &meta, &map) != 0) return -1;
+
+    int32_t mapped = 0;
+    for (int k = 0; k < map.count; k++) mapped += map.e[k].seg.len;
+    fprintf(out, "Segments: %d, holes: %d bytes\n", map.count, meta.size - mapped);
+
+    for (int k = 0; k < map.count; k++) {
+        const file_segment *seg = &map.e[k].seg;
+        extent_ref ext;
+        if (segment_extent(file_descriptor, seg, &ext) == -1) continue;
+        fprintf(out, "  [%d, %d) at %d, extent %d+%d (refs %d)\n", seg->pos, seg_end(seg),
+                seg->start, ext.start, ext.size, ext.refs);
+    }
 
     return 0;
 }
-int get_fs_stats(int fd) {
+int get_fs_stats(int fd, FILE *out) {
     file_system_header header;
     if (read_fs_header(fd, &header) != 0) return -1;
 
@@ -275,10 +1382,10 @@ int get_fs_stats(int fd) {
 
     int32_t used_space = total_size - free_space;
 
-    printf("Filesystem Stats:\n");
-    printf("Number of files: %d\n", header.files_count);
-    printf("Used space: %d bytes\n", used_space);
-    printf("Free space: %d bytes\n", free_space);
+    fprintf(out, "Filesystem Stats:\n");
+    fprintf(out, "Number of files: %d\n", header.files_count);
+    fprintf(out, "Used space: %d bytes\n", used_space);
+    fprintf(out, "Free space: %d bytes\n", free_space);
 
     return 0;
 }
@@ -290,6 +1397,22 @@ int free_block_offset(int index) {
          + sizeof(free_block) * index;
 }
 
+int extent_ref_offset(int index) {
+    return free_block_offset(MAX_FREE_BLOCKS) + sizeof(extent_ref) * index;
+}
+
+int segment_offset(int index) {
+    return extent_ref_offset(MAX_EXTENTS) + sizeof(file_segment) * index;
+}
+
+int snapshot_entry_offset(int index) {
+    return segment_offset(MAX_SEGMENTS) + sizeof(snapshot_entry) * index;
+}
+
+int data_region_offset(void) {
+    return snapshot_entry_offset(MAX_SNAPSHOTS);
+}
+
 
 int read_free_block(int file_descriptor, int index, free_block *block) {
     off_t off = free_block_offset(index);
@@ -302,6 +1425,7 @@ int write_free_block(int file_descriptor, int index, const free_block *block) {
     off_t off = free_block_offset(index);
     if (lseek(file_descriptor, off, SEEK_SET) == -1) return -1;
     if (write(file_descriptor, block, sizeof(*block)) != sizeof(*block)) return -1;
+    writeback_note(file_descriptor, off, sizeof(*block));
     return 0;
 }
 
@@ -448,6 +1572,33 @@ int init_free_list(int file_descriptor) {
     return 0;
 }
 
+/* Take `size` bytes from the front of free block `cur` (prev = its
+ * predecessor in the list, -1 for the head) and return their start. */
+static int take_from_block(int fd, file_system_header *header, int prev, int cur,
+                           free_block *blk, int32_t size) {
+    int alloc_start = blk->start;
+    if (blk->size == size) {
+        /* exact fit: remove this node from list */
+        if (prev == -1) {
+            header->free_list_head = blk->next;
+        } else {
+            free_block prevblk;
+            if (read_free_block(fd, prev, &prevblk) != 0) return -1;
+            prevblk.next = blk->next;
+            if (write_free_block(fd, prev, &prevblk) != 0) return -1;
+        }
+        if (zero_free_block_slot(fd, cur) != 0) return -1;
+    } else {
+        /* consume front of block */
+        blk->start += size;
+        blk->size  -= size;
+        if (write_free_block(fd, cur, blk) != 0) return -1;
+    }
+
+    if (write_fs_header(fd, header) != 0) return -1;
+    return alloc_start;
+}
+
 /* allocate_space: first-fit; adjust or remove block and return allocated start */
 int allocate_space(int fd, int32_t size) {
     if (size <= 0) return -1;
@@ -462,29 +1613,33 @@ int allocate_space(int fd, int32_t size) {
         free_block blk;
         if (read_free_block(fd, cur, &blk) != 0) return -1;
         if (blk.start == -1) { cur = blk.next; iter++; continue; }
-        if (blk.size >= size) {
-            int alloc_start = blk.start;
-            if (blk.size == size) {
-                /* exact fit: remove this node from list */
-                if (prev == -1) {
-                    header.free_list_head = blk.next;
-                } else {
-                    free_block prevblk;
-                    if (read_free_block(fd, prev, &prevblk) != 0) return -1;
-                    prevblk.next = blk.next;
-                    if (write_free_block(fd, prev, &prevblk) != 0) return -1;
-                }
-                if (zero_free_block_slot(fd, cur) != 0) return -1;
-            } else {
-                /* consume front of block */
-                blk.start += size;
-                blk.size  -= size;
-                if (write_free_block(fd, cur, &blk) != 0) return -1;
-            }
+        if (blk.size >= size)
+            return take_from_block(fd, &header, prev, cur, &blk, size);
+        prev = cur;
+        cur = blk.next;
+        iter++;
+    }
+    return -1;
+}
 
-            if (write_fs_header(fd, &header) != 0) return -1;
-            return alloc_start;
-        }
+/* allocate_at: take exactly [start, start + size) if a free block begins at
+ * start and is big enough. Lets an extent grow in place. */
+int allocate_at(int fd, int32_t start, int32_t size) {
+    if (size <= 0) return -1;
+    file_system_header header;
+    if (read_fs_header(fd, &header) != 0) return -1;
+
+    int prev = -1;
+    int cur = header.free_list_head;
+    int iter = 0;
+    while (cur != -1 && iter < MAX_FREE_BLOCKS) {
+        if (cur < 0 || cur >= MAX_FREE_BLOCKS) return -1; /* sanity */
+        free_block blk;
+        if (read_free_block(fd, cur, &blk) != 0) return -1;
+        if (blk.start == -1) { cur = blk.next; iter++; continue; }
+        if (blk.start > start) break;   /* list is sorted by start */
+        if (blk.start == start)
+            return blk.size >= size ? take_from_block(fd, &header, prev, cur, &blk, size) : -1;
         prev = cur;
         cur = blk.next;
         iter++;
@@ -515,12 +1670,8 @@ int free_space(int file_descriptor, int32_t start, int32_t size) {
     if (read_fs_header(file_descriptor, &header) != 0) return -1;
 
     // Basic validation: start must be >= data region start
-    int32_t header_size = sizeof(file_system_header);
-    int32_t metadata_total = sizeof(file_metadata) * MAX_FILES;
-    int32_t freeblocks_total = sizeof(free_block) * MAX_FREE_BLOCKS;
-    int32_t data_start = header_size + metadata_total + freeblocks_total;
-    if (start < data_start) {
-        // invalid free region (would overlap metadata / free-block table)
+    if (start < data_region_offset()) {
+        // invalid free region (would overlap metadata / free-block / extent / snapshot tables)
         return -1;
     }
 
@@ -582,3 +1733,526 @@ void merge_free_list(int fd)
         // DO NOT MOVE CUR — try merging again (a may merge further)
     }
 }
+
+
+
+// ---------------- Extent reference table ----------------
+
+int read_extent_ref(int file_descriptor, int index, extent_ref *ext) {
+    off_t off = extent_ref_offset(index);
+    if (lseek(file_descriptor, off, SEEK_SET) == -1) return -1;
+    if (read(file_descriptor, ext, sizeof(*ext)) != sizeof(*ext)) return -1;
+    return 0;
+}
+
+int write_extent_ref(int file_descriptor, int index, const extent_ref *ext) {
+    __atomic_add_fetch(&fs_generation, 1, __ATOMIC_RELAXED);
+    off_t off = extent_ref_offset(index);
+    if (lseek(file_descriptor, off, SEEK_SET) == -1) return -1;
+    if (write(file_descriptor, ext, sizeof(*ext)) != sizeof(*ext)) return -1;
+    writeback_note(file_descriptor, off, sizeof(*ext));
+    extent_index_set_extent(file_descriptor, index, ext->start);
+    return 0;
+}
+
+// Returns the slot describing the extent that begins at `start`, or -1.
+int find_extent_ref(int file_descriptor, int32_t start) {
+    int found = extent_index_lookup(file_descriptor, start);
+    if (found != EXTENT_INDEX_UNAVAILABLE) return found;
+
+    extent_ref ext;
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        if (read_extent_ref(file_descriptor, i, &ext) != 0) continue;
+        if (ext.start != -1 && ext.start == start) return i;
+    }
+    return -1;
+}
+
+static int find_free_extent_slot(int file_descriptor) {
+    int slot = extent_index_free_extent(file_descriptor);
+    if (slot != EXTENT_INDEX_UNAVAILABLE) return slot;
+
+    extent_ref ext;
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        if (read_extent_ref(file_descriptor, i, &ext) != 0) continue;
+        if (ext.start == -1) return i;
+    }
+    return -1;
+}
+
+// Record a freshly allocated extent with a single owner.
+int extent_register(int file_descriptor, int32_t start, int32_t size) {
+    int slot = find_free_extent_slot(file_descriptor);
+    if (slot == -1) {
+        printf("Extent table FULL!\n");
+        return -1;
+    }
+
+    extent_ref ext;
+    ext.start = start;
+    ext.size  = size;
+    ext.refs  = 1;
+    return write_extent_ref(file_descriptor, slot, &ext);
+}
+
+int extent_acquire(int file_descriptor, int32_t start) {
+    int slot = find_extent_ref(file_descriptor, start);
+    if (slot == -1) return -1;
+
+    extent_ref ext;
+    if (read_extent_ref(file_descriptor, slot, &ext) != 0) return -1;
+    ext.refs++;
+    return write_extent_ref(file_descriptor, slot, &ext);
+}
+
+// Drop one reference; the space goes back to the free list with the last one.
+int extent_release(int file_descriptor, int32_t start) {
+    int slot = find_extent_ref(file_descriptor, start);
+    if (slot == -1) return -1;
+
+    extent_ref ext;
+    if (read_extent_ref(file_descriptor, slot, &ext) != 0) return -1;
+
+    if (--ext.refs > 0)
+        return write_extent_ref(file_descriptor, slot, &ext);
+
+    if (ext.size > 0 && free_space(file_descriptor, ext.start, ext.size) != 0)
+        return -1;
+
+    ext.start = -1;
+    ext.size  = 0;
+    ext.refs  = 0;
+    return write_extent_ref(file_descriptor, slot, &ext);
+}
+
+
+// ---------------- Snapshots ----------------
+
+static int read_snapshot_entry(int fd, int index, snapshot_entry *snap) {
+    off_t off = snapshot_entry_offset(index);
+    if (lseek(fd, off, SEEK_SET) == -1) return -1;
+    if (read(fd, snap, sizeof(*snap)) != sizeof(*snap)) return -1;
+    return 0;
+}
+
+static int write_snapshot_entry(int fd, int index, const snapshot_entry *snap) {
+    off_t off = snapshot_entry_offset(index);
+    if (lseek(fd, off, SEEK_SET) == -1) return -1;
+    if (write(fd, snap, sizeof(*snap)) != sizeof(*snap)) return -1;
+    writeback_note(fd, off, sizeof(*snap));
+    return 0;
+}
+
+static int find_snapshot(int fd, const char *name) {
+    snapshot_entry snap;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (read_snapshot_entry(fd, i, &snap) != 0) continue;
+        if (snap.table_offset == 0) continue;
+        if (strcmp(snap.name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// A snapshot stores the metadata table followed by the segment table
+#define SNAPSHOT_META_SIZE ((int32_t)sizeof(file_metadata) * MAX_FILES)
+#define SNAPSHOT_SIZE (SNAPSHOT_META_SIZE + (int32_t)sizeof(file_segment) * MAX_SEGMENTS)
+
+/* Load a whole segment table (live or frozen) in one read. */
+static file_segment *load_segment_table(int fd, int32_t table_offset) {
+    size_t table_size = sizeof(file_segment) * MAX_SEGMENTS;
+    file_segment *table = malloc(table_size);
+    if (!table) return NULL;
+
+    if (pread(fd, table, table_size, table_offset) != (ssize_t)table_size) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+/* Freeze the metadata and segment tables: copy them into the data region
+ * and take a reference on every extent a segment lies in. No file data is
+ * copied. */
+int snapshot_create(int fd, const char *name) {
+    snapshot_entry snap;
+    if (mount_of(fd)) return -1;
+    if (name[0] == 0 || strlen(name) >= sizeof(snap.name)) return -1;
+
+    if (find_snapshot(fd, name) != -1) {
+        printf("Snapshot '%s' already exists.\n", name);
+        return -1;
+    }
+
+    // The snapshot must include what streams have already accepted
+    if (flush_streams(fd, -1) != 0) return -1;
+
+    int slot = -1;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (read_snapshot_entry(fd, i, &snap) != 0) continue;
+        if (snap.table_offset == 0) { slot = i; break; }
+    }
+    if (slot == -1) {
+        printf("Snapshot table FULL!\n");
+        return -1;
+    }
+
+    file_system_header header;
+    if (read_fs_header(fd, &header) != 0) return -1;
+
+    char *tables = malloc(SNAPSHOT_SIZE);
+    if (!tables) return -1;
+    if (pread(fd, tables, SNAPSHOT_META_SIZE, sizeof(file_system_header)) != SNAPSHOT_META_SIZE ||
+        pread(fd, tables + SNAPSHOT_META_SIZE, SNAPSHOT_SIZE - SNAPSHOT_META_SIZE,
+              segment_offset(0)) != SNAPSHOT_SIZE - SNAPSHOT_META_SIZE) {
+        free(tables);
+        return -1;
+    }
+
+    int off = allocate_space(fd, SNAPSHOT_SIZE);
+    if (off == -1) {
+        printf("No free space!\n");
+        free(tables);
+        return -1;
+    }
+
+    if (pwrite(fd, tables, SNAPSHOT_SIZE, off) != SNAPSHOT_SIZE) {
+        free_space(fd, off, SNAPSHOT_SIZE);
+        free(tables);
+        return -1;
+    }
+    writeback_note(fd, off, SNAPSHOT_SIZE);
+
+    // Pin every extent the frozen segments lie in
+    file_segment *segs = (file_segment *)(tables + SNAPSHOT_META_SIZE);
+    for (int i = 0; i < MAX_SEGMENTS; i++) {
+        if (segs[i].start == -1) continue;
+        extent_acquire(fd, segs[i].extent);
+    }
+    free(tables);
+
+    memset(&snap, 0, sizeof(snap));
+    strncpy(snap.name, name, sizeof(snap.name) - 1);
+    snap.table_offset = off;
+    snap.files_count = header.files_count;
+    return write_snapshot_entry(fd, slot, &snap);
+}
+
+int snapshot_delete(int fd, const char *name) {
+    int slot = find_snapshot(fd, name);
+    if (slot == -1) return -1;
+    snapshot_mount_entry *m = mount_of(fd);
+    if (m && m->slot == slot) {
+        printf("Snapshot '%s' is mounted.\n", name);
+        return -1;
+    }
+
+    snapshot_entry snap;
+    if (read_snapshot_entry(fd, slot, &snap) != 0) return -1;
+
+    file_segment *segs = load_segment_table(fd, snap.table_offset + SNAPSHOT_META_SIZE);
+    if (!segs) return -1;
+
+    // Release the snapshot's references; extents no live file uses are freed
+    for (int i = 0; i < MAX_SEGMENTS; i++) {
+        if (segs[i].start == -1) continue;
+        extent_release(fd, segs[i].extent);
+    }
+    free(segs);
+
+    if (free_space(fd, snap.table_offset, SNAPSHOT_SIZE) != 0)
+        return -1;
+
+    memset(&snap, 0, sizeof(snap));
+    return write_snapshot_entry(fd, slot, &snap);
+}
+
+/* Serve reads from the snapshot's frozen tables; all writes fail until unmount. */
+int snapshot_mount(int fd, const char *name) {
+    int slot = find_snapshot(fd, name);
+    if (slot == -1) return -1;
+
+    snapshot_entry snap;
+    if (read_snapshot_entry(fd, slot, &snap) != 0) return -1;
+
+    // Pending stream writes belong to the live tables; land them while they can be
+    if (!mount_of(fd) && flush_streams(fd, -1) != 0) return -1;
+
+    // Mounting over a mounted snapshot just switches tables
+    snapshot_mount_entry *m = mount_of(fd);
+    if (m) __atomic_store_n(&m->mounted, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < MAX_MOUNTS && !m; i++) {
+        if (!__atomic_load_n(&mounts[i].mounted, __ATOMIC_ACQUIRE)) m = &mounts[i];
+    }
+    if (!m) {
+        printf("Too many mounted snapshots!\n");
+        return -1;
+    }
+
+    m->fd = fd;
+    m->slot = slot;
+    m->metadata_offset = snap.table_offset;
+    m->segment_offset = snap.table_offset + SNAPSHOT_META_SIZE;
+    __atomic_store_n(&m->mounted, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&fs_generation, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int snapshot_unmount(int fd) {
+    snapshot_mount_entry *m = mount_of(fd);
+    if (!m) return -1;
+
+    __atomic_store_n(&m->mounted, 0, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&fs_generation, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int snapshot_mounted(int fd) {
+    return mount_of(fd) != NULL;
+}
+
+void snapshot_list(int fd) {
+    snapshot_mount_entry *m = mount_of(fd);
+    snapshot_entry snap;
+    printf("Snapshots:\n");
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (read_snapshot_entry(fd, i, &snap) != 0) continue;
+        if (snap.table_offset == 0) continue;
+        printf("  %s files=%d table=%d%s\n", snap.name, snap.files_count,
+               snap.table_offset, m && i == m->slot ? " (mounted)" : "");
+    }
+}
+
+
+// ---------------- Image setup ----------------
+
+// Drop the in-memory indexes kept for fd. Called when an image is opened,
+// since a reused fd number must not see the indexes of one closed earlier.
+void forget_image(int file_descriptor) {
+    name_index_drop(file_descriptor);
+    attr_index_drop(file_descriptor);
+    extent_index_drop(file_descriptor);
+}
+
+// Only one process may own the image; a second one would corrupt the free list
+static int lock_image(int file_descriptor, const char *path) {
+    if (flock(file_descriptor, LOCK_EX | LOCK_NB) == 0) return 0;
+    printf("Error: %s is in use by another process.\n", path);
+    close(file_descriptor);
+    return -1;
+}
+
+/* Lay out an empty filesystem of size_bytes on an open, locked image. */
+static int format_image(int file_descriptor, int32_t size_bytes) {
+    if (ftruncate(file_descriptor, size_bytes) != 0) {
+        perror("ftruncate");
+        return -1;
+    }
+
+    // Build header
+    file_system_header header;
+    header.magic = 0xDEADBEEF;
+    header.file_system_version = FILE_SYSTEM_VERSION;
+    header.files_count = 0;
+
+    int32_t header_size = sizeof(file_system_header);
+    int32_t metadata_size = sizeof(file_metadata);
+
+    int32_t metadata_area = sizeof(file_metadata) * MAX_FILES;
+
+    // DATA START = end of header + metadata + free blocks + extent refs + segments + snapshots
+    header.last_allocated_offset = data_region_offset();
+
+    // Write header
+    lseek(file_descriptor, 0, SEEK_SET);
+    write(file_descriptor, &header, sizeof(header));
+    // Zero metadata
+    char zero[4096] = {0};
+    lseek(file_descriptor, header_size, SEEK_SET);
+
+    size_t total_meta = metadata_size * MAX_FILES;
+    while (total_meta > 0) {
+        size_t chunk = total_meta > 4096 ? 4096 : total_meta;
+        write(file_descriptor, zero, chunk);
+        total_meta -= chunk;
+    }
+
+    // Zero free-block, extent, segment and snapshot areas (VERY IMPORTANT)
+    lseek(file_descriptor, header_size + metadata_area, SEEK_SET);
+
+    size_t total_fb = data_region_offset() - (header_size + metadata_area);
+    while (total_fb > 0) {
+        size_t chunk = total_fb > 4096 ? 4096 : total_fb;
+        write(file_descriptor, zero, chunk);
+        total_fb -= chunk;
+    }
+        // Mark all free-block slots as empty (start = -1)
+    for (int i = 0; i < MAX_FREE_BLOCKS; i++) {
+        free_block empty;
+        empty.start = -1;
+        empty.size  = 0;
+        empty.next  = -1;
+        write_free_block(file_descriptor,
+                        i,
+                        &empty);
+    }
+    // Mark all extent slots as empty (start = -1); snapshot slots stay zeroed
+    for (int i = 0; i < MAX_EXTENTS; i++) {
+        extent_ref empty;
+        empty.start = -1;
+        empty.size  = 0;
+        empty.refs  = 0;
+        write_extent_ref(file_descriptor, i, &empty);
+    }
+    // Same for segment slots
+    for (int i = 0; i < MAX_SEGMENTS; i++) {
+        file_segment empty = { 0, -1, 0, 0, -1 };
+        write_segment(file_descriptor, i, &empty);
+    }
+
+
+    // Initialize free list (the missing part causing freeze)
+    if (init_free_list(file_descriptor) != 0) return -1;
+
+    fsync(file_descriptor);
+    return 0;
+}
+
+// Version 1: header | metadata | free blocks | data, one contiguous run per file
+#define V1_DATA_OFFSET ((int32_t)(sizeof(file_system_header) + sizeof(file_metadata) * MAX_FILES \
+                                  + sizeof(free_block) * MAX_FREE_BLOCKS))
+
+/* Copy every file of a version 1 image into a freshly formatted one. */
+static int copy_v1_files(int old_fd, int new_fd, off_t old_size) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        file_metadata old;
+        off_t off = sizeof(file_system_header) + (off_t)sizeof(file_metadata) * i;
+        if (pread(old_fd, &old, sizeof(old), off) != sizeof(old)) return -1;
+        if (old.name[0] == 0) continue;
+        old.name[sizeof(old.name) - 1] = 0;
+
+        if (old.size < 0 || (old.size > 0 && (old.data_offset < V1_DATA_OFFSET ||
+                                               old.data_offset + (off_t)old.size > old_size))) {
+            printf("Error: file '%s' points outside the image.\n", old.name);
+            return -1;
+        }
+
+        file_handler fh = open_file(new_fd, old.name, CREATE);
+        if (!fh.is_open) return -1;
+        if (old.size > 0) {
+            char *data = malloc(old.size);
+            int ok = data && pread(old_fd, data, old.size, old.data_offset) == old.size &&
+                     fs_write(new_fd, &fh, 0, data, old.size) == old.size;
+            free(data);
+            if (!ok) return -1;
+        }
+
+        file_metadata meta;
+        if (read_metadata(new_fd, fh.metadata_index, &meta) != 0) return -1;
+        meta.type = old.type;
+        meta.permission = old.permission;
+        if (write_metadata(new_fd, fh.metadata_index, &meta) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Upgrade a version 1 image. Its data sits where the extent and segment
+ * tables now go, and its free list cannot be trusted, so the files are
+ * copied into a new image built next to it, which then takes its place.
+ * The original is kept as <path>.v1. Returns the new image's fd or -1,
+ * leaving the original untouched. */
+static int upgrade_v1_image(int old_fd, const char *path) {
+    struct stat st;
+    if (fstat(old_fd, &st) != 0) return -1;
+    // Same room for data as before, on top of the bigger tables
+    off_t new_size = st.st_size - V1_DATA_OFFSET + data_region_offset();
+    if (new_size > INT32_MAX) return -1;
+
+    char tmp_path[PATH_MAX], old_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.upgrade", path) >= (int)sizeof(tmp_path) ||
+        snprintf(old_path, sizeof(old_path), "%s.v1", path) >= (int)sizeof(old_path))
+        return -1;
+
+    printf("Upgrading %s from version 1 to version %d (original kept as %s)...\n",
+           path, FILE_SYSTEM_VERSION, old_path);
+
+    int new_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (new_fd == -1) {
+        perror(tmp_path);
+        return -1;
+    }
+    if (lock_image(new_fd, tmp_path) != 0) return -1;
+    forget_image(new_fd);
+
+    int rc = 0;
+    if (format_image(new_fd, new_size) != 0 || copy_v1_files(old_fd, new_fd, st.st_size) != 0 ||
+        fsync(new_fd) != 0)
+        rc = -1;
+    else if (link(path, old_path) != 0 || rename(tmp_path, path) != 0) {
+        perror(old_path);
+        rc = -1;
+    }
+    if (rc != 0) {
+        printf("Error: upgrade of %s failed; leaving it untouched.\n", path);
+        forget_image(new_fd);
+        close(new_fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    return new_fd;
+}
+
+int initialize_filesystem(const char *path, int32_t size_bytes) {
+    int file_descriptor = open(path, O_RDWR);
+
+    if (file_descriptor != -1) {
+        if (lock_image(file_descriptor, path) != 0) return -1;
+
+        // filesystem.db exists so verify header
+        file_system_header header;
+        ssize_t got = read(file_descriptor, &header, sizeof(header));
+
+        if (got == sizeof(header) && header.magic == 0xDEADBEEF &&
+            header.file_system_version == FILE_SYSTEM_VERSION) {
+            printf("Filesystem loaded.\n");
+            forget_image(file_descriptor);
+            return file_descriptor;
+        }
+
+        if (got == sizeof(header) && header.magic == 0xDEADBEEF && header.file_system_version == 1) {
+            int upgraded = upgrade_v1_image(file_descriptor, path);
+            close(file_descriptor);
+            return upgraded;
+        }
+
+        // Only an empty file is formatted; anything else may hold someone's data
+        if (got != 0) {
+            if (got != sizeof(header) || header.magic != 0xDEADBEEF)
+                printf("Error: %s is not a filesystem image; leaving it untouched.\n", path);
+            else
+                printf("Error: %s is filesystem version %d, this build reads version %d; "
+                       "leaving it untouched.\n", path, header.file_system_version, FILE_SYSTEM_VERSION);
+            close(file_descriptor);
+            return -1;
+        }
+        close(file_descriptor);
+        printf("%s is empty — creating new filesystem...\n", path);
+    } else {
+        printf("%s not found — creating new filesystem...\n", path);
+    }
+
+    file_descriptor = open(path, O_RDWR | O_CREAT, 0644);
+    if (file_descriptor == -1) {
+        perror("open");
+        return -1;
+    }
+    if (lock_image(file_descriptor, path) != 0) return -1;
+    forget_image(file_descriptor);
+
+    if (format_image(file_descriptor, size_bytes) != 0) {
+        close(file_descriptor);
+        return -1;
+    }
+
+    printf("Filesystem created successfully.\n");
+    return file_descriptor;
+}
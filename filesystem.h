@@ -1,7 +1,9 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #pragma pack(push, 1)
 typedef struct {
@@ -21,11 +23,14 @@ typedef struct {
     int32_t type;
     int32_t permission;
     int32_t size;
-    int32_t data_offset;
-    int32_t next; 
+    int32_t data_offset;    // image offset of the first segment, 0 if none
+    int32_t next;           // first segment of the file's data map, -1 if none
 } file_metadata;
 #pragma pack(pop)
 
+// permission carries the owner id in its high 16 bits, mode bits below
+#define FILE_OWNER(permission) ((int32_t)(((uint32_t)(permission) >> 16) & 0xFFFF))
+
 
 typedef struct {
     int32_t metadata_index;
@@ -37,7 +42,16 @@ typedef struct {
 
 #define MAX_FILES 1024
 #define CREATE 1
+#define DELAY_ALLOC 2   // stream_open: buffer dirty data, allocate on flush/close
+#define FILE_SYSTEM_VERSION 3
+
 
+// Open filesys.db-style image at path, creating and formatting it with
+// size_bytes if missing or empty. A version 1 image is upgraded (the
+// original is kept as <path>.v1); other versions, or any other non-empty
+// file, are refused rather than reformatted. Returns the locked image fd or -1.
+int initialize_filesystem(const char *path, int32_t size_bytes);
+void forget_image(int file_descriptor);    // drop per-fd indexes; call before close
 
 // Load and save FS header
 int read_fs_header(int file_descriptor, file_system_header *header);
@@ -54,17 +68,46 @@ int find_free_metadata_slot(int file_descriptor);
 file_handler open_file(int file_descriptor, const char *filename, int flags);
 int close_file(file_handler *fh);
 
+// Streaming handles: a persistent open-file table whose entries cache the
+// resolved metadata and extent, advance fh.pos, read ahead sequentially and
+// coalesce small writes. Returns/takes a handle id (index into the table).
+#define MAX_OPEN_FILES 64
+#define STREAM_BUFFER_SIZE 4096
+
+int stream_open(int file_descriptor, const char *filename, int flags);
+int stream_find(int file_descriptor, int metadata_index);
+int stream_close(int handle);
+int stream_flush(int handle);
+int stream_read(int handle, char *buffer, int32_t n);
+int stream_write(int handle, const char *buffer, int32_t n);
+int32_t stream_seek(int handle, int32_t offset, int whence);
+
+// Durability: flush stream buffers and sync the image (see writeback.h)
+int fs_sync(int file_descriptor);
+
 // Read / Write
 int fs_read(int file_descriptor, file_handler *fh, int32_t pos, int32_t n, char *buffer);
 int fs_write(int file_descriptor, file_handler *fh, int32_t pos, const char *buffer, int32_t n);
+// Vectored forms: buffers are consecutive in the file from pos (at most IOV_MAX)
+int fs_readv(int file_descriptor, file_handler *fh, int32_t pos, const struct iovec *iov, int iovcnt);
+int fs_writev(int file_descriptor, file_handler *fh, int32_t pos, const struct iovec *iov, int iovcnt);
+int fs_fallocate(int file_descriptor, file_handler *fh, int32_t size);
+int fs_punch_hole(int file_descriptor, file_handler *fh, int32_t pos, int32_t len);
 
 // File operations
 int shrink_file(int file_descriptor, file_handler *fh, int32_t new_size);
 int rm_file(int file_descriptor, file_handler *fh);
+int fs_clone(int file_descriptor, const char *src, const char *dst);
+int fs_set_type(int file_descriptor, file_handler *fh, int32_t type);
+int fs_set_owner(int file_descriptor, file_handler *fh, int32_t owner);   // FILE_OWNER, 0..65535
+
+// Host file transfer (kernel-side copy, no user-space buffers)
+int fs_import(int file_descriptor, const char *host_path, const char *filename);
+int fs_export(int file_descriptor, const char *filename, const char *host_path);
 
 // Stats
-int get_file_stats(int file_descriptor, file_handler *fh);
-int get_fs_stats(int file_descriptor);
+int get_file_stats(int file_descriptor, file_handler *fh, FILE *out);
+int get_fs_stats(int file_descriptor, FILE *out);
 
 // Free List Structures
 #pragma pack(push, 1)
@@ -78,6 +121,7 @@ typedef struct {
 int init_free_list(int file_descriptor);
 int find_free_block(int file_descriptor, int32_t size);
 int allocate_space(int file_descriptor, int32_t size); // returns offset
+int allocate_at(int file_descriptor, int32_t start, int32_t size);
 void merge_free_list(int file_descriptor);
 int free_space(int file_descriptor, int32_t start, int32_t size);
 
@@ -87,5 +131,73 @@ int write_free_block(int file_descriptor, int index, const free_block *block);
 void print_free_list(int file_descriptor);
 #define MAX_FREE_BLOCKS 1024
 
+// Extent reference table: one entry per allocated file data extent.
+// refs counts the files and snapshots pointing at the extent, so shared
+// data is only returned to the free list when the last reference goes.
+#pragma pack(push, 1)
+typedef struct {
+    int32_t start;   // -1 = unused slot
+    int32_t size;    // bytes allocated
+    int32_t refs;
+} extent_ref;
+#pragma pack(pop)
+
+#define MAX_EXTENTS 2048
+
+int read_extent_ref(int file_descriptor, int index, extent_ref *ext);
+int write_extent_ref(int file_descriptor, int index, const extent_ref *ext);
+int find_extent_ref(int file_descriptor, int32_t start);
+int extent_register(int file_descriptor, int32_t start, int32_t size);
+int extent_acquire(int file_descriptor, int32_t start);
+int extent_release(int file_descriptor, int32_t start);
+
+// File data map: a file's bytes live in a chain of segments sorted by file
+// position, starting at meta.next. Ranges of [0, size) that no segment
+// covers are holes: they read back as zeros and take no space. Each segment
+// holds one reference on the extent it lies in.
+#pragma pack(push, 1)
+typedef struct {
+    int32_t pos;      // file position of the first byte
+    int32_t start;    // image offset of the first byte, -1 = unused slot
+    int32_t len;      // bytes of data
+    int32_t extent;   // start of the backing extent
+    int32_t next;     // next segment of the file, -1 = last
+} file_segment;
+#pragma pack(pop)
+
+#define MAX_SEGMENTS 2048
+#define MAX_FILE_SEGMENTS 64
+#define SPARSE_GAP 4096     // write gaps up to this size are zero-filled, not left as holes
+
+int read_segment(int file_descriptor, int index, file_segment *seg);
+int write_segment(int file_descriptor, int index, const file_segment *seg);
+
+// Snapshots: a frozen copy of the metadata and segment tables stored in the data region.
+// Extents referenced by a snapshot are pinned through extent_ref, so later
+// writes to the live file are redirected to a new extent (copy-on-write).
+#pragma pack(push, 1)
+typedef struct {
+    char name[32];
+    int32_t table_offset;   // metadata table, then segment table; 0 = unused slot
+    int32_t files_count;
+} snapshot_entry;
+#pragma pack(pop)
+
+#define MAX_SNAPSHOTS 16
+
+int snapshot_create(int file_descriptor, const char *name);
+int snapshot_delete(int file_descriptor, const char *name);
+int snapshot_mount(int file_descriptor, const char *name);
+int snapshot_unmount(int file_descriptor);
+void snapshot_list(int file_descriptor);
+int snapshot_mounted(int file_descriptor);   // 1 while a snapshot replaces its live tables
+
+// On-disk layout: header | metadata | free blocks | extent refs | segments | snapshots | data
+int free_block_offset(int index);
+int extent_ref_offset(int index);
+int segment_offset(int index);
+int snapshot_entry_offset(int index);
+int data_region_offset(void);
+
 
 #endif
@@ -0,0 +1,134 @@
+/* Load generator for the daemon: runs N client threads, each on its own
+ * connection, keeping `depth` requests in flight, and reports ops/s for a
+ * series of client counts.
+
+   usage: loadgen socket_path [ops_per_client] [depth] [clients...]
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "client.h"
+
+#define RECORD_SIZE 64
+
+typedef struct {
+    const char *socket_path;
+    int id;
+    long ops;
+    int depth;
+    long done;
+    int failed;
+} client_args;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Alternate 64-byte writes and reads over a 1 KiB file of the client's own
+static int64_t send_op(fs_client *c, const char *name, long i, const char *record) {
+    int32_t pos = (i / 2 % 16) * RECORD_SIZE;
+    if (i % 2 == 0)
+        return fsc_send(c, FSP_WRITE, 0, name, pos, record, RECORD_SIZE);
+    return fsc_send(c, FSP_READ, 0, name, pos, NULL, RECORD_SIZE);
+}
+
+static void *client_main(void *arg) {
+    client_args *a = arg;
+    fs_client c;
+    if (fsc_connect(&c, a->socket_path) != 0) {
+        a->failed = 1;
+        return NULL;
+    }
+
+    char name[32], record[RECORD_SIZE], buf[RECORD_SIZE];
+    snprintf(name, sizeof(name), "lg%d", a->id);
+    memset(record, 'a' + a->id % 26, sizeof(record));
+
+    // Size the file up front so the measured writes never allocate
+    if (fsc_open(&c, name, CREATE) < 0 ||
+        fsc_write(&c, name, 16 * RECORD_SIZE - 1, "", 1) < 0) {
+        a->failed = 1;
+        fsc_disconnect(&c);
+        return NULL;
+    }
+
+    long sent = 0;
+    while (sent < a->ops && sent < a->depth) {
+        if (send_op(&c, name, sent, record) == -1) { a->failed = 1; break; }
+        sent++;
+    }
+
+    fsp_response resp;
+    while (!a->failed && a->done < a->ops) {
+        if (fsc_recv(&c, &resp, buf, sizeof(buf)) != 0 || resp.status < 0) {
+            a->failed = 1;
+            break;
+        }
+        a->done++;
+        if (sent < a->ops) {
+            if (send_op(&c, name, sent, record) == -1) { a->failed = 1; break; }
+            sent++;
+        }
+    }
+
+    fsc_rm(&c, name);
+    fsc_disconnect(&c);
+    return NULL;
+}
+
+static int run_round(const char *socket_path, int clients, long ops, int depth) {
+    pthread_t threads[clients];
+    client_args args[clients];
+
+    double t0 = now_seconds();
+    for (int i = 0; i < clients; i++) {
+        args[i] = (client_args){ socket_path, i, ops, depth, 0, 0 };
+        pthread_create(&threads[i], NULL, client_main, &args[i]);
+    }
+
+    long total = 0;
+    int failed = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        total += args[i].done;
+        failed |= args[i].failed;
+    }
+    double elapsed = now_seconds() - t0;
+
+    printf("  %7d %10ld %10.3f %12.0f%s\n", clients, total, elapsed,
+           elapsed > 0 ? total / elapsed : 0.0, failed ? "  (errors)" : "");
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s socket_path [ops_per_client] [depth] [clients...]\n", argv[0]);
+        return 1;
+    }
+
+    const char *socket_path = argv[1];
+    long ops = argc > 2 ? atol(argv[2]) : 20000;
+    int depth = argc > 3 ? atoi(argv[3]) : 8;
+    if (depth < 1) depth = 1;
+
+    int default_counts[] = { 1, 2, 4, 8, 16 };
+    int rounds = argc > 4 ? argc - 4 : 5;
+
+    printf("Load: %ld ops/client, pipeline depth %d\n", ops, depth);
+    printf("  %7s %10s %10s %12s\n", "clients", "ops", "seconds", "ops/s");
+
+    int rc = 0;
+    for (int r = 0; r < rounds; r++) {
+        int clients = argc > 4 ? atoi(argv[4 + r]) : default_counts[r];
+        if (clients < 1) continue;
+        if (run_round(socket_path, clients, ops, depth) != 0) rc = 1;
+    }
+    return rc;
+}
@@ -1,109 +1,91 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <sys/stat.h>
+#include <time.h>
 
 #include "filesystem.h"
-
-int initialize_filesystem(const char *path, int32_t size_bytes) {
-    int file_descriptor = open(path, O_RDWR);
-
-    if (file_descriptor != -1) {
-        // filesystem.db exists so verify header
-        file_system_header header;
-
-        if (read(file_descriptor, &header, sizeof(header)) != sizeof(header)) {
-            printf("Error: filesys.db is unavailable. Reinitializing...\n");
-        } else if (header.magic == 0xDEADBEEF && header.file_system_version == 1) {
-            printf("Filesystem loaded.\n");
-            return file_descriptor;
-        }
-
-        // If unavailable then reinit
-        close(file_descriptor);
-    }
-
-    // Create new filesystem
-    printf("filesys.db not found — creating new filesystem...\n");
-
-    file_descriptor = open(path, O_RDWR | O_CREAT, 0644);
-    if (file_descriptor == -1) {
-        perror("open");
-        return -1;
-    }
-
-    if (ftruncate(file_descriptor, size_bytes) != 0) {
-        perror("ftruncate");
-        close(file_descriptor);
+#include "attr_index.h"
+#include "batch.h"
+#include "server.h"
+#include "writeback.h"
+
+// Look up a file's streaming handle, attaching one on first use
+static int shell_handle(int file_descriptor, const char *name) {
+    int idx = find_file_by_name(file_descriptor, name);
+    if (idx == -1) {
+        printf("File not found.\n");
         return -1;
     }
 
-    // Build header
-    file_system_header header;
-    header.magic = 0xDEADBEEF;
-    header.file_system_version = 1;
-    header.files_count = 0;
-
-    int32_t header_size = sizeof(file_system_header);
-    int32_t metadata_size = sizeof(file_metadata);
-
-    int32_t metadata_area = sizeof(file_metadata) * MAX_FILES;
-    int32_t freeblock_area = sizeof(free_block) * MAX_FREE_BLOCKS;
-
-    // DATA START = end of header + metadata + free blocks
-    header.last_allocated_offset = header_size + metadata_area + freeblock_area;
-
-    // Write header
-    lseek(file_descriptor, 0, SEEK_SET);
-    write(file_descriptor, &header, sizeof(header));
-    // Zero metadata
-    char zero[4096] = {0};
-    lseek(file_descriptor, header_size, SEEK_SET);
-
-    size_t total_meta = metadata_size * MAX_FILES;
-    while (total_meta > 0) {
-        size_t chunk = total_meta > 4096 ? 4096 : total_meta;
-        write(file_descriptor, zero, chunk);
-        total_meta -= chunk;
-    }
+    int h = stream_find(file_descriptor, idx);
+    if (h == -1)
+        h = stream_open(file_descriptor, name, 0);
+    return h;
+}
 
-    // Zero free-block area (VERY IMPORTANT)
-    lseek(file_descriptor, header_size + metadata_area, SEEK_SET);
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
 
-    size_t total_fb = sizeof(free_block) * MAX_FREE_BLOCKS;
-    while (total_fb > 0) {
-        size_t chunk = total_fb > 4096 ? 4096 : total_fb;
-        write(file_descriptor, zero, chunk);
-        total_fb -= chunk;
-    }
-        // Mark all free-block slots as empty (start = -1)
-    for (int i = 0; i < MAX_FREE_BLOCKS; i++) {
-        free_block empty;
-        empty.start = -1;
-        empty.size  = 0;
-        empty.next  = -1;
-        write_free_block(file_descriptor,
-                        i,
-                        &empty);
+// Print attribute index entries; names come from the live metadata table
+static void print_entries(int file_descriptor, const attr_entry *entries, int count) {
+    file_metadata meta;
+    for (int i = 0; i < count; i++) {
+        if (read_metadata(file_descriptor, entries[i].index, &meta) != 0) continue;
+        printf("  %-24s %10d bytes  type %d  owner %d\n", meta.name,
+               entries[i].size, entries[i].type, entries[i].owner);
     }
-
-
-    // Initialize free list (the missing part causing freeze)
-    init_free_list(file_descriptor);
-
-    fsync(file_descriptor);
-
-    printf("Filesystem created successfully.\n");
-    return file_descriptor;
 }
 
 
 // MAIN SHELL
-int main() {
+// Usage: main                       interactive shell
+//        main -b script [-j jobs]   replay a script/trace and report throughput
+//        main -s socket [-j jobs]   serve clients over a Unix socket (daemon)
+// Any mode: -i ms     write-back interval (default 1000, 0 = no flusher)
+//           -d bytes  dirty bytes that trigger an early write-back (default 4 MiB)
+int main(int argc, char **argv) {
+    const char *script = NULL, *socket_path = NULL;
+    int jobs = 1;
+    int wb_interval = 1000;
+    long wb_dirty = 4 * 1024 * 1024;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) script = argv[++i];
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) socket_path = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) jobs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) wb_interval = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) wb_dirty = atol(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [-b script | -s socket] [-j jobs] [-i ms] [-d bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+
     int file_descriptor = initialize_filesystem("filesys.db", 1024 * 1024); // 1MB
     if (file_descriptor == -1) return 1;
 
+    if (writeback_start(file_descriptor, wb_interval, wb_dirty) != 0)
+        fprintf(stderr, "Warning: no write-back thread; use 'sync' to persist.\n");
+
+    if (socket_path) {
+        int rc = run_server(file_descriptor, socket_path, jobs);
+        writeback_stop(file_descriptor);
+        close(file_descriptor);
+        return rc == 0 ? 0 : 1;
+    }
+
+    if (script) {
+        int rc = run_batch(file_descriptor, script, jobs);
+        for (int h = 0; h < MAX_OPEN_FILES; h++)
+            stream_close(h);
+        writeback_stop(file_descriptor);
+        close(file_descriptor);
+        return rc == 0 ? 0 : 1;
+    }
+
     char command[256];
     char arg1[128], arg2[128];
     int pos, n;
@@ -119,14 +101,23 @@ int main() {
 
         // OPEN
         if (sscanf(command, "open %s %s", arg1, arg2) == 2) {
-            int flags = (strcmp(arg2, "CREATE") == 0) ? CREATE : 0;
-
-            file_handler fh = open_file(file_descriptor, arg1, flags);
-            if (fh.is_open)
-                printf("Opened file %s.\n", arg1);
-            else
+            // CREATE, DELAY or CREATE|DELAY
+            int flags = (strstr(arg2, "CREATE") ? CREATE : 0) |
+                        (strstr(arg2, "DELAY") ? DELAY_ALLOC : 0);
+
+            // Handles are attached by the first stream command; only DELAY
+            // needs one now, to keep the flag. The file never depends on it.
+            file_handler fh = open_file(file_descriptor, arg1, flags & CREATE);
+            if (!fh.is_open) {
                 printf("Failed to open %s.\n", arg1);
+                continue;
+            }
 
+            if ((flags & DELAY_ALLOC) && stream_find(file_descriptor, fh.metadata_index) == -1 &&
+                stream_open(file_descriptor, arg1, DELAY_ALLOC) == -1)
+                printf("No free stream handle: writes to %s are not delayed.\n", arg1);
+
+            printf("Opened file %s.\n", arg1);
             continue;
         }
 
@@ -169,6 +160,81 @@ int main() {
             continue;
         }
 
+        // STREAM READ / WRITE / SEEK (on a file opened with 'open')
+        if (sscanf(command, "sread %s %d", arg1, &n) == 2) {
+            int h = shell_handle(file_descriptor, arg1);
+            if (h == -1) continue;
+
+            char buf[4096];
+            if (n > (int)sizeof(buf) - 1) n = sizeof(buf) - 1;
+            int r = stream_read(h, buf, n);
+
+            if (r > 0) {
+                buf[r] = '\0';
+                printf("Read: %s\n", buf);
+            } else {
+                printf("Nothing read.\n");
+            }
+            continue;
+        }
+
+        if (sscanf(command, "swrite %s %s", arg1, arg2) == 2) {
+            int h = shell_handle(file_descriptor, arg1);
+            if (h == -1) continue;
+
+            int w = stream_write(h, arg2, strlen(arg2));
+            printf("Wrote %d bytes.\n", w);
+            continue;
+        }
+
+        if (sscanf(command, "seek %s %d", arg1, &pos) == 2) {
+            int h = shell_handle(file_descriptor, arg1);
+            if (h == -1) continue;
+
+            printf("Position %d.\n", stream_seek(h, pos, SEEK_SET));
+            continue;
+        }
+
+        if (sscanf(command, "flush %s", arg1) == 1) {
+            int h = shell_handle(file_descriptor, arg1);
+            if (h == -1) continue;
+
+            printf(stream_flush(h) == 0 ? "Flushed %s.\n" : "Flush failed.\n", arg1);
+            continue;
+        }
+
+        // FALLOCATE (reserve a contiguous extent without changing the size)
+        if (sscanf(command, "fallocate %s %d", arg1, &n) == 2) {
+            int idx = find_file_by_name(file_descriptor, arg1);
+            if (idx == -1) {
+                printf("File not found.\n");
+                continue;
+            }
+
+            file_handler fh = { idx, 0, 1 };
+            if (fs_fallocate(file_descriptor, &fh, n) == 0)
+                printf("Reserved %d bytes for %s.\n", n, arg1);
+            else
+                printf("Fallocate failed.\n");
+            continue;
+        }
+
+        // PUNCH (deallocate a range; it reads back as zeros)
+        if (sscanf(command, "punch %s %d %d", arg1, &pos, &n) == 3) {
+            int idx = find_file_by_name(file_descriptor, arg1);
+            if (idx == -1) {
+                printf("File not found.\n");
+                continue;
+            }
+
+            file_handler fh = { idx, 0, 1 };
+            if (fs_punch_hole(file_descriptor, &fh, pos, n) == 0)
+                printf("Punched %d bytes at %d in %s.\n", n, pos, arg1);
+            else
+                printf("Punch failed.\n");
+            continue;
+        }
+
         // RM
         if (sscanf(command, "rm %s", arg1) == 1) {
             int idx = find_file_by_name(file_descriptor, arg1);
@@ -178,10 +244,40 @@ int main() {
                 continue;
             }
 
+            int h = stream_find(file_descriptor, idx);
             file_handler fh = { idx, 0, 1 };
-            rm_file(file_descriptor, &fh);
+            if ((h == -1 || stream_close(h) == 0) && rm_file(file_descriptor, &fh) == 0)
+                printf("Removed %s.\n", arg1);
+            else
+                printf("Remove failed.\n");
+            continue;
+        }
+
+        // CLONE (new file sharing src's data until one of them is written)
+        if (sscanf(command, "clone %s %s", arg1, arg2) == 2) {
+            if (fs_clone(file_descriptor, arg1, arg2) == 0)
+                printf("Cloned %s to %s.\n", arg1, arg2);
+            else
+                printf("Clone failed.\n");
+            continue;
+        }
+
+        // IMPORT / EXPORT (whole host files)
+        if (sscanf(command, "import %s %s", arg1, arg2) == 2) {
+            int r = fs_import(file_descriptor, arg1, arg2);
+            if (r >= 0)
+                printf("Imported %d bytes into %s.\n", r, arg2);
+            else
+                printf("Import failed.\n");
+            continue;
+        }
 
-            printf("Removed %s.\n", arg1);
+        if (sscanf(command, "export %s %s", arg1, arg2) == 2) {
+            int r = fs_export(file_descriptor, arg1, arg2);
+            if (r >= 0)
+                printf("Exported %d bytes to %s.\n", r, arg2);
+            else
+                printf("Export failed.\n");
             continue;
         }
 
@@ -195,13 +291,72 @@ int main() {
             }
 
             file_handler fh = { idx, 0, 1 };
-            get_file_stats(file_descriptor, &fh);
+            get_file_stats(file_descriptor, &fh, stdout);
             continue;
         }
 
         // FS STATS
         if (strcmp(command, "fsstat\n") == 0) {
-            get_fs_stats(file_descriptor);
+            get_fs_stats(file_descriptor, stdout);
+            continue;
+        }
+
+        // TOP N (largest files, from the attribute index)
+        if (sscanf(command, "top %d", &n) == 1) {
+            if (snapshot_mounted(file_descriptor)) {
+                printf("Unmount the snapshot first.\n");
+                continue;
+            }
+            attr_entry entries[MAX_FILES];
+            double t0 = now_us();
+            int count = attr_index_top(file_descriptor, n, entries);
+            double took = now_us() - t0;
+            if (count < 0) {
+                printf("Attribute index unavailable.\n");
+                continue;
+            }
+            print_entries(file_descriptor, entries, count);
+            printf("%d file(s) in %.1f us\n", count, took);
+            continue;
+        }
+
+        // LS-TYPE T (files of one type, largest first)
+        if (sscanf(command, "ls-type %d", &n) == 1) {
+            if (snapshot_mounted(file_descriptor)) {
+                printf("Unmount the snapshot first.\n");
+                continue;
+            }
+            attr_entry entries[MAX_FILES];
+            double t0 = now_us();
+            int count = attr_index_by_type(file_descriptor, n, entries, MAX_FILES);
+            double took = now_us() - t0;
+            if (count < 0) {
+                printf("Attribute index unavailable.\n");
+                continue;
+            }
+            print_entries(file_descriptor, entries, count);
+            printf("%d file(s) in %.1f us\n", count, took);
+            continue;
+        }
+
+        // DU-BY-TYPE (file count and bytes per type)
+        if (strcmp(command, "du-by-type\n") == 0) {
+            if (snapshot_mounted(file_descriptor)) {
+                printf("Unmount the snapshot first.\n");
+                continue;
+            }
+            type_usage usage[MAX_FILES];
+            double t0 = now_us();
+            int count = attr_index_usage(file_descriptor, usage, MAX_FILES);
+            double took = now_us() - t0;
+            if (count < 0) {
+                printf("Attribute index unavailable.\n");
+                continue;
+            }
+            for (int i = 0; i < count; i++)
+                printf("  type %-6d %6d file(s) %12lld bytes\n", usage[i].type,
+                       usage[i].files, (long long)usage[i].bytes);
+            printf("%d type(s) in %.1f us\n", count, took);
             continue;
         }
         // ALLOC (allocates a block of 'n' bytes and prints the start offset)
@@ -225,6 +380,56 @@ int main() {
             continue;
         }
 
+        // SNAPSHOTS
+        if (strcmp(command, "snapshot list\n") == 0) {
+            snapshot_list(file_descriptor);
+            continue;
+        }
+
+        if (strcmp(command, "snapshot unmount\n") == 0) {
+            if (snapshot_unmount(file_descriptor) == 0)
+                printf("Snapshot unmounted.\n");
+            else
+                printf("No snapshot mounted.\n");
+            continue;
+        }
+
+        if (sscanf(command, "snapshot create %127s", arg1) == 1) {
+            if (snapshot_create(file_descriptor, arg1) == 0)
+                printf("Snapshot %s created.\n", arg1);
+            else
+                printf("Snapshot failed.\n");
+            continue;
+        }
+
+        if (sscanf(command, "snapshot mount %127s", arg1) == 1) {
+            if (snapshot_mount(file_descriptor, arg1) == 0)
+                printf("Snapshot %s mounted read-only.\n", arg1);
+            else
+                printf("Snapshot not found.\n");
+            continue;
+        }
+
+        if (sscanf(command, "snapshot delete %127s", arg1) == 1) {
+            if (snapshot_delete(file_descriptor, arg1) == 0)
+                printf("Snapshot %s deleted.\n", arg1);
+            else
+                printf("Delete failed.\n");
+            continue;
+        }
+
+        // SYNC (durability barrier)
+        if (strcmp(command, "sync\n") == 0) {
+            printf(fs_sync(file_descriptor) == 0 ? "Synced.\n" : "Sync failed.\n");
+            continue;
+        }
+
+        // WBSTAT (write-back state)
+        if (strcmp(command, "wbstat\n") == 0) {
+            writeback_stats(file_descriptor);
+            continue;
+        }
+
         // VIZ (print free list)
         if (strcmp(command, "viz\n") == 0) {
             print_free_list(file_descriptor);
@@ -250,6 +455,25 @@ int main() {
             continue;
         }
 
+        // CHTYPE / CHOWN (the attributes top, ls-type and du-by-type report)
+        if (sscanf(command, "chtype %s %d", arg1, &n) == 2 ||
+            sscanf(command, "chown %s %d", arg1, &n) == 2) {
+            int idx = find_file_by_name(file_descriptor, arg1);
+            if (idx == -1) {
+                printf("File not found.\n");
+                continue;
+            }
+
+            file_handler fh = { idx, 0, 1 };
+            int owner = strncmp(command, "chown", 5) == 0;
+            int rc = owner ? fs_set_owner(file_descriptor, &fh, n) : fs_set_type(file_descriptor, &fh, n);
+            if (rc == 0)
+                printf("Set %s of %s to %d.\n", owner ? "owner" : "type", arg1, n);
+            else
+                printf("Change failed.\n");
+            continue;
+        }
+
         // CLOSE
         if (sscanf(command, "close %s", arg1) == 1) {
 
@@ -259,9 +483,8 @@ int main() {
                 continue;
             }
 
-            file_handler fh = { idx, 0, 1 };
-
-            if (close_file(&fh) == 0)
+            int h = stream_find(file_descriptor, idx);
+            if (h == -1 || stream_close(h) == 0)
                 printf("Closed %s.\n", arg1);
             else
                 printf("Close failed.\n");
@@ -276,6 +499,10 @@ int main() {
         printf("Unknown command.\n");
     }
 
+    for (int h = 0; h < MAX_OPEN_FILES; h++)
+        stream_close(h);
+
+    writeback_stop(file_descriptor);
     close(file_descriptor);
     return 0;
 }
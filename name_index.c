@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesystem.h"
+#include "name_index.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define NAME_ROW 64
+#define MAX_INDEXED_IMAGES 16
+
+typedef struct {
+    int fd;                      // -1 = unused
+    char (*names)[NAME_ROW];     // MAX_FILES rows, 64-byte aligned, zero padded
+    uint32_t *tags;              // MAX_FILES hash tags, 0 = empty slot
+} name_index;
+
+static name_index indexes[MAX_INDEXED_IMAGES];
+static int indexes_ready = 0;
+static int mode = NAME_INDEX_AUTO;
+
+
+// FNV-1a; never 0 so that 0 can mean "empty slot"
+static uint32_t name_tag(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static void set_row(name_index *ix, int i, const char *name) {
+    memset(ix->names[i], 0, NAME_ROW);
+    if (name[0] == 0) {
+        ix->tags[i] = 0;
+        return;
+    }
+    strncpy(ix->names[i], name, NAME_ROW - 1);
+    ix->tags[i] = name_tag(ix->names[i]);
+}
+
+static int resolve_mode(int m) {
+    if (m != NAME_INDEX_AUTO) return m;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return NAME_INDEX_AVX2;
+    if (__builtin_cpu_supports("sse2")) return NAME_INDEX_SSE2;
+#endif
+    return NAME_INDEX_SCALAR;
+}
+
+int name_index_set_mode(int m) {
+    int resolved = resolve_mode(m);
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (resolved == NAME_INDEX_AVX2 && !__builtin_cpu_supports("avx2")) return -1;
+    if (resolved == NAME_INDEX_SSE2 && !__builtin_cpu_supports("sse2")) return -1;
+#else
+    if (resolved == NAME_INDEX_AVX2 || resolved == NAME_INDEX_SSE2) return -1;
+#endif
+    mode = resolved;
+    return mode;
+}
+
+/* Find the index for fd, building it from one read of the metadata table
+ * the first time. NULL if the index is off or could not be built. */
+static name_index *get_index(int fd) {
+    if (mode == NAME_INDEX_OFF) return NULL;
+    if (mode == NAME_INDEX_AUTO) mode = resolve_mode(mode);
+
+    if (!indexes_ready) {
+        for (int i = 0; i < MAX_INDEXED_IMAGES; i++) indexes[i].fd = -1;
+        indexes_ready = 1;
+    }
+
+    name_index *slot = NULL;
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i].fd == fd) return &indexes[i];
+        if (indexes[i].fd == -1 && !slot) slot = &indexes[i];
+    }
+    if (!slot) return NULL;
+
+    size_t table_size = sizeof(file_metadata) * MAX_FILES;
+    file_metadata *table = malloc(table_size);
+    slot->names = aligned_alloc(64, (size_t)MAX_FILES * NAME_ROW);
+    slot->tags = aligned_alloc(64, sizeof(uint32_t) * MAX_FILES);
+
+    if (!table || !slot->names || !slot->tags ||
+        pread(fd, table, table_size, sizeof(file_system_header)) != (ssize_t)table_size) {
+        free(table);
+        free(slot->names);
+        free(slot->tags);
+        return NULL;
+    }
+
+    for (int i = 0; i < MAX_FILES; i++)
+        set_row(slot, i, table[i].name);
+    free(table);
+
+    slot->fd = fd;
+    return slot;
+}
+
+void name_index_update(int fd, int index, const file_metadata *meta) {
+    if (!indexes_ready || index < 0 || index >= MAX_FILES) return;
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i].fd == fd) {
+            set_row(&indexes[i], index, meta->name);
+            return;
+        }
+    }
+}
+
+void name_index_drop(int fd) {
+    if (!indexes_ready) return;
+    for (int i = 0; i < MAX_INDEXED_IMAGES; i++) {
+        if (indexes[i].fd != fd) continue;
+        free(indexes[i].names);
+        free(indexes[i].tags);
+        indexes[i].names = NULL;
+        indexes[i].tags = NULL;
+        indexes[i].fd = -1;
+    }
+}
+
+
+// ---------------- Scalar ----------------
+
+static int lookup_scalar(const name_index *ix, uint32_t tag, const char *row) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (ix->tags[i] == tag && memcmp(ix->names[i], row, NAME_ROW) == 0) return i;
+    }
+    return -1;
+}
+
+static int free_slot_scalar(const name_index *ix) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (ix->tags[i] == 0) return i;
+    }
+    return -1;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// ---------------- SSE2: 4 tags per compare ----------------
+
+__attribute__((target("sse2")))
+static int row_equal_sse2(const char *a, const char *b) {
+    __m128i eq = _mm_set1_epi8(-1);
+    for (int k = 0; k < NAME_ROW; k += 16) {
+        __m128i x = _mm_load_si128((const __m128i *)(a + k));
+        __m128i y = _mm_load_si128((const __m128i *)(b + k));
+        eq = _mm_and_si128(eq, _mm_cmpeq_epi8(x, y));
+    }
+    return _mm_movemask_epi8(eq) == 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static int scan_tags_sse2(const name_index *ix, uint32_t tag, const char *row) {
+    __m128i t = _mm_set1_epi32((int)tag);
+    for (int i = 0; i < MAX_FILES; i += 4) {
+        __m128i v = _mm_load_si128((const __m128i *)(ix->tags + i));
+        unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, t)));
+        while (mask) {
+            int j = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (!row || row_equal_sse2(ix->names[j], row)) return j;
+        }
+    }
+    return -1;
+}
+
+// ---------------- AVX2: 8 tags per compare ----------------
+
+__attribute__((target("avx2")))
+static int row_equal_avx2(const char *a, const char *b) {
+    __m256i lo = _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)a),
+                                   _mm256_load_si256((const __m256i *)b));
+    __m256i hi = _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)(a + 32)),
+                                   _mm256_load_si256((const __m256i *)(b + 32)));
+    return _mm256_movemask_epi8(_mm256_and_si256(lo, hi)) == -1;
+}
+
+__attribute__((target("avx2")))
+static int scan_tags_avx2(const name_index *ix, uint32_t tag, const char *row) {
+    __m256i t = _mm256_set1_epi32((int)tag);
+    for (int i = 0; i < MAX_FILES; i += 8) {
+        __m256i v = _mm256_load_si256((const __m256i *)(ix->tags + i));
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, t)));
+        while (mask) {
+            int j = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (!row || row_equal_avx2(ix->names[j], row)) return j;
+        }
+    }
+    return -1;
+}
+
+#endif
+
+
+/* Returns the metadata index of filename, -1 if absent, or
+ * NAME_INDEX_UNAVAILABLE when there is no index to answer from. */
+int name_index_lookup(int fd, const char *filename) {
+    name_index *ix = get_index(fd);
+    if (!ix) return NAME_INDEX_UNAVAILABLE;
+    if (filename[0] == 0 || strlen(filename) >= NAME_ROW) return -1;
+
+    // Query padded to a full aligned row, like the stored names
+    _Alignas(64) char row[NAME_ROW];
+    memset(row, 0, sizeof(row));
+    strncpy(row, filename, NAME_ROW - 1);
+    uint32_t tag = name_tag(row);
+
+#ifdef HAVE_X86_SIMD
+    if (mode == NAME_INDEX_AVX2) return scan_tags_avx2(ix, tag, row);
+    if (mode == NAME_INDEX_SSE2) return scan_tags_sse2(ix, tag, row);
+#endif
+    return lookup_scalar(ix, tag, row);
+}
+
+int name_index_free_slot(int fd) {
+    name_index *ix = get_index(fd);
+    if (!ix) return NAME_INDEX_UNAVAILABLE;
+
+#ifdef HAVE_X86_SIMD
+    if (mode == NAME_INDEX_AVX2) return scan_tags_avx2(ix, 0, NULL);
+    if (mode == NAME_INDEX_SSE2) return scan_tags_sse2(ix, 0, NULL);
+#endif
+    return free_slot_scalar(ix);
+}
@@ -0,0 +1,28 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include "filesystem.h"
+
+// In-memory, structure-of-arrays index over the live metadata table, built
+// on first use for each image fd. Names sit in 64-byte aligned rows and a
+// separate column holds a 32-bit hash tag per slot (0 = empty slot), so
+// lookups compare 8 (AVX2) or 4 (SSE2) tags per instruction and only touch
+// the name rows of candidate slots. write_metadata keeps it up to date.
+
+#define NAME_INDEX_OFF    0   // no index: scan the metadata table on disk
+#define NAME_INDEX_SCALAR 1
+#define NAME_INDEX_SSE2   2
+#define NAME_INDEX_AVX2   3
+#define NAME_INDEX_AUTO   4   // best the CPU supports (default)
+
+#define NAME_INDEX_UNAVAILABLE -2   // lookup result: caller must scan itself
+
+int name_index_lookup(int file_descriptor, const char *filename);
+int name_index_free_slot(int file_descriptor);
+void name_index_update(int file_descriptor, int index, const file_metadata *meta);
+void name_index_drop(int file_descriptor);
+
+// Returns the mode now in effect, or -1 if the CPU lacks it
+int name_index_set_mode(int mode);
+
+#endif
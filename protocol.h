@@ -0,0 +1,40 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// Binary protocol between the daemon (server.c) and clients (client.c).
+// Every request is an fsp_request followed by name_len name bytes and, for
+// WRITE, len payload bytes. Every response is an fsp_response followed by
+// len payload bytes. Responses carry the request id, so a client may keep
+// several requests in flight (pipelining) and match replies by id.
+
+#define FSP_OPEN  1
+#define FSP_READ  2
+#define FSP_WRITE 3
+#define FSP_RM    4
+#define FSP_STAT  5
+
+#define FSP_CREATE 1        // request flag for FSP_OPEN
+
+#define FSP_MAX_NAME 63
+#define FSP_MAX_IO   65536  // largest READ/WRITE payload
+
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t  op;
+    uint8_t  flags;
+    uint16_t name_len;
+    uint32_t id;
+    int32_t  pos;
+    int32_t  len;       // READ: bytes wanted, WRITE: payload bytes after the name
+} fsp_request;
+
+typedef struct {
+    uint32_t id;
+    int32_t  status;    // OPEN: metadata index, READ/WRITE: bytes, STAT: size, -1 = error
+    int32_t  len;       // payload bytes that follow (READ data, STAT file_metadata)
+} fsp_response;
+#pragma pack(pop)
+
+#endif
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "filesystem.h"
+#include "protocol.h"
+#include "server.h"
+
+#define MAX_EVENTS 64
+#define INBUF_SIZE (2 * (sizeof(fsp_request) + FSP_MAX_NAME + FSP_MAX_IO))
+#define OUTBUF_LIMIT (1 << 20)  // stop reading requests while this much output waits
+#define MAX_PENDING 256         // ... or this many requests are unanswered
+
+/* Sockets are non-blocking: a worker appends its response to the
+ * connection's output and sends what the socket takes at once; the event
+ * loop sends the rest when the socket has room. A client that stops
+ * reading only stalls itself. */
+typedef struct {
+    int sock;
+    int refs;               // event loop + queued jobs (atomic)
+    pthread_mutex_t wlock;  // guards everything up to in_len
+    int events;             // epoll interest registered for sock
+    int pending;            // requests queued but not answered
+    int eof;                // client will send no more requests
+    int failed;             // socket error or bad frame: drop without answering
+    int closed;             // out of the event loop; later output is dropped
+    char *outbuf;           // responses not yet sent: [out_off, out_len)
+    size_t out_off, out_len, out_cap;
+    size_t in_len;          // the input buffer belongs to the event loop
+    char inbuf[INBUF_SIZE];
+} connection;
+
+typedef struct job {
+    connection *conn;
+    fsp_request req;
+    char name[FSP_MAX_NAME + 1];
+    char *data;             // WRITE payload
+    struct job *next;
+} job;
+
+// One FIFO per worker. All requests of a connection go to the same worker,
+// so pipelined requests on a connection run in the order they were sent.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    job *head, *tail;
+} job_queue;
+
+static job_queue *queues = NULL;
+static int queue_count = 0;
+static int stopping = 0;
+
+// The filesystem API is not thread-safe; workers take turns inside it.
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int image_fd = -1;
+static int epoll_fd = -1;
+
+static volatile sig_atomic_t got_signal = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    got_signal = 1;
+}
+
+
+static void release_connection(connection *c) {
+    if (__atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(c->sock);
+        pthread_mutex_destroy(&c->wlock);
+        free(c->outbuf);
+        free(c);
+    }
+}
+
+static void enqueue(job *j) {
+    job_queue *q = &queues[j->conn->sock % queue_count];
+    __atomic_add_fetch(&j->conn->refs, 1, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_lock(&j->conn->wlock);
+    j->conn->pending++;
+    pthread_mutex_unlock(&j->conn->wlock);
+
+    pthread_mutex_lock(&q->lock);
+    j->next = NULL;
+    if (q->tail) q->tail->next = j;
+    else q->head = j;
+    q->tail = j;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static job *dequeue(job_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (!q->head && !stopping)
+        pthread_cond_wait(&q->cond, &q->lock);
+
+    job *j = q->head;
+    if (j) {
+        q->head = j->next;
+        if (!q->head) q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return j;
+}
+
+/* Run one request against the image. Returns the response status and
+ * fills payload/payload_len for READ and STAT. */
+static int32_t execute(const job *j, char *payload, int32_t *payload_len) {
+    int fd = image_fd;
+    *payload_len = 0;
+
+    if (j->req.op == FSP_OPEN) {
+        file_handler fh = open_file(fd, j->name, (j->req.flags & FSP_CREATE) ? CREATE : 0);
+        return fh.is_open ? fh.metadata_index : -1;
+    }
+
+    int idx = find_file_by_name(fd, j->name);
+    if (idx == -1) return -1;
+    file_handler fh = { idx, 0, 1 };
+
+    switch (j->req.op) {
+    case FSP_READ: {
+        int r = fs_read(fd, &fh, j->req.pos, j->req.len, payload);
+        if (r > 0) *payload_len = r;
+        return r;
+    }
+    case FSP_WRITE:
+        return fs_write(fd, &fh, j->req.pos, j->data, j->req.len);
+    case FSP_RM: {
+        int h = stream_find(fd, idx);
+        if (h != -1) stream_close(h);
+        return rm_file(fd, &fh);
+    }
+    case FSP_STAT: {
+        file_metadata meta;
+        if (read_metadata(fd, idx, &meta) != 0) return -1;
+        memcpy(payload, &meta, sizeof(meta));
+        *payload_len = sizeof(meta);
+        return meta.size;
+    }
+    }
+    return -1;
+}
+
+// The helpers below are called with c->wlock held.
+
+static int queue_output(connection *c, const char *buf, size_t len) {
+    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + len) cap *= 2;
+        char *grown = realloc(c->outbuf, cap);
+        if (!grown) return -1;
+        c->outbuf = grown;
+        c->out_cap = cap;
+    }
+    memcpy(c->outbuf + c->out_len, buf, len);
+    c->out_len += len;
+    return 0;
+}
+
+// Send as much queued output as the socket takes without blocking
+static int send_output(connection *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t w = send(c->sock, c->outbuf + c->out_off, c->out_len - c->out_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (w == -1 && errno == EINTR) continue;
+        if (w == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (w <= 0) return -1;
+        c->out_off += w;
+    }
+    c->out_off = c->out_len = 0;
+    return 0;
+}
+
+// Nothing more to read, answer or send: the event loop can let go
+static int finished(const connection *c) {
+    return c->failed || (c->eof && c->pending == 0 && c->out_off == c->out_len);
+}
+
+/* Point the loop's interest in c at its next step: room to send queued
+ * output, more requests unless too much is waiting, or the end. Workers
+ * call this too; only the loop removes a connection, since it may still
+ * hold an event for it. */
+static void rearm(connection *c) {
+    if (c->closed) return;
+
+    size_t backlog = c->out_len - c->out_off;
+    int events = 0;
+    if (backlog > 0 || finished(c)) events |= EPOLLOUT;
+    if (!c->eof && !c->failed && backlog < OUTBUF_LIMIT && c->pending < MAX_PENDING)
+        events |= EPOLLIN;
+    if (events == c->events) return;
+
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->sock, &ev);
+    c->events = events;
+}
+
+static void *worker_main(void *arg) {
+    job_queue *q = arg;
+    char *out = malloc(sizeof(fsp_response) + FSP_MAX_IO);
+    if (!out) return NULL;
+
+    job *j;
+    while ((j = dequeue(q)) != NULL) {
+        fsp_response *resp = (fsp_response *)out;
+        int32_t payload_len;
+
+        pthread_mutex_lock(&fs_mutex);
+        resp->status = execute(j, out + sizeof(*resp), &payload_len);
+        pthread_mutex_unlock(&fs_mutex);
+
+        resp->id = j->req.id;
+        resp->len = payload_len;
+
+        connection *c = j->conn;
+        pthread_mutex_lock(&c->wlock);
+        c->pending--;
+        if (!c->closed && !c->failed &&
+            (queue_output(c, out, sizeof(*resp) + payload_len) != 0 || send_output(c) != 0))
+            c->failed = 1;
+        rearm(c);
+        pthread_mutex_unlock(&c->wlock);
+
+        release_connection(j->conn);
+        free(j->data);
+        free(j);
+    }
+
+    free(out);
+    return NULL;
+}
+
+/* Cut complete frames out of the connection's input buffer and queue them.
+ * Returns -1 on a malformed frame. */
+static int drain_frames(connection *c) {
+    size_t used = 0;
+
+    while (c->in_len - used >= sizeof(fsp_request)) {
+        fsp_request req;
+        memcpy(&req, c->inbuf + used, sizeof(req));
+
+        if (req.op < FSP_OPEN || req.op > FSP_STAT) return -1;
+        if (req.name_len == 0 || req.name_len > FSP_MAX_NAME) return -1;
+        if (req.len < 0 || req.len > FSP_MAX_IO) return -1;
+
+        size_t data_len = (req.op == FSP_WRITE) ? (size_t)req.len : 0;
+        size_t frame = sizeof(req) + req.name_len + data_len;
+        if (c->in_len - used < frame) break;
+
+        job *j = calloc(1, sizeof(*j));
+        if (!j) return -1;
+        j->conn = c;
+        j->req = req;
+        memcpy(j->name, c->inbuf + used + sizeof(req), req.name_len);
+        if (data_len > 0) {
+            j->data = malloc(data_len);
+            if (!j->data) { free(j); return -1; }
+            memcpy(j->data, c->inbuf + used + sizeof(req) + req.name_len, data_len);
+        }
+        enqueue(j);
+        used += frame;
+    }
+
+    memmove(c->inbuf, c->inbuf + used, c->in_len - used);
+    c->in_len -= used;
+    return 0;
+}
+
+int run_server(int file_descriptor, const char *socket_path, int workers) {
+    image_fd = file_descriptor;
+    if (workers < 1) workers = 1;
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    unlink(socket_path);
+
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 128) != 0) {
+        perror(socket_path);
+        close(listener);
+        return -1;
+    }
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    epoll_fd = ep;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(ep, EPOLL_CTL_ADD, listener, &ev);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    queue_count = workers;
+    queues = calloc(workers, sizeof(*queues));
+    pthread_t threads[workers];
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        pthread_cond_init(&queues[i].cond, NULL);
+        pthread_create(&threads[i], NULL, worker_main, &queues[i]);
+    }
+
+    printf("Serving on %s with %d workers.\n", socket_path, workers);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!got_signal) {
+        int ready = epoll_wait(ep, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            connection *c = events[i].data.ptr;
+
+            // New client
+            if (c == NULL) {
+                int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (sock == -1) continue;
+
+                c = calloc(1, sizeof(*c));
+                if (!c) { close(sock); continue; }
+                c->sock = sock;
+                c->refs = 1;
+                c->events = EPOLLIN;
+                pthread_mutex_init(&c->wlock, NULL);
+
+                struct epoll_event cev = { .events = EPOLLIN, .data.ptr = c };
+                epoll_ctl(ep, EPOLL_CTL_ADD, sock, &cev);
+                continue;
+            }
+
+            uint32_t ready_events = events[i].events;
+            int eof = 0, failed = 0;
+
+            // Requests; after end of input a hang-up means the client is gone
+            if (ready_events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (c->eof) {
+                    failed = (ready_events & (EPOLLHUP | EPOLLERR)) != 0;
+                } else {
+                    ssize_t r = read(c->sock, c->inbuf + c->in_len, INBUF_SIZE - c->in_len);
+                    if (r > 0) {
+                        c->in_len += r;
+                        failed = drain_frames(c) != 0;
+                    } else if (r == 0) {
+                        eof = 1;
+                    } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        failed = 1;
+                    }
+                }
+            }
+
+            pthread_mutex_lock(&c->wlock);
+            if (eof) c->eof = 1;
+            if (failed) c->failed = 1;
+            if (!c->failed && send_output(c) != 0) c->failed = 1;
+
+            int drop = finished(c);
+            if (drop) {
+                // Queued jobs keep the memory alive; their output is dropped
+                epoll_ctl(ep, EPOLL_CTL_DEL, c->sock, NULL);
+                shutdown(c->sock, SHUT_RDWR);
+                c->closed = 1;
+            } else {
+                rearm(c);
+            }
+            pthread_mutex_unlock(&c->wlock);
+            if (drop) release_connection(c);
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_lock(&queues[i].lock);
+        stopping = 1;
+        pthread_cond_broadcast(&queues[i].cond);
+        pthread_mutex_unlock(&queues[i].lock);
+    }
+    for (int i = 0; i < workers; i++)
+        pthread_join(threads[i], NULL);
+    free(queues);
+
+    close(ep);
+    close(listener);
+    unlink(socket_path);
+    printf("Server stopped.\n");
+    return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// Daemon mode: own the image and serve local clients over a Unix domain
+// socket (protocol.h). An epoll loop reads and frames requests, a pool of
+// worker threads executes them and queues the responses on non-blocking
+// sockets, and the loop sends whatever a slow reader has not taken yet.
+int run_server(int file_descriptor, const char *socket_path, int workers);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "filesystem.h"
+#include "name_index.h"
+#include "attr_index.h"
+#include "extent_index.h"
+#include "volume.h"
+
+
+int volume_open(fs_volume *v, const char *const *paths, int count, int32_t shard_size) {
+    if (count < 1 || count > MAX_SHARDS) return -1;
+
+    v->shard_count = 0;
+    for (int i = 0; i < count; i++) {
+        int fd = initialize_filesystem(paths[i], shard_size);
+        if (fd == -1) {
+            volume_close(v);
+            return -1;
+        }
+
+        // Build the per-fd indexes now, while only this thread touches their
+        // tables; shard threads then only look up and update their own entry
+        name_index_lookup(fd, "");
+        extent_index_lookup(fd, -1);
+        attr_index_top(fd, 0, NULL);
+
+        v->fds[i] = fd;
+        pthread_mutex_init(&v->locks[i], NULL);
+        v->shard_count++;
+    }
+    return 0;
+}
+
+void volume_close(fs_volume *v) {
+    for (int i = 0; i < v->shard_count; i++) {
+        fsync(v->fds[i]);
+        forget_image(v->fds[i]);
+        close(v->fds[i]);
+        pthread_mutex_destroy(&v->locks[i]);
+    }
+    v->shard_count = 0;
+}
+
+// FNV-1a over the name, so routing is stable across runs
+int volume_shard_for(const fs_volume *v, const char *filename) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)filename; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h % v->shard_count;
+}
+
+int volume_create(fs_volume *v, const char *filename) {
+    int s = volume_shard_for(v, filename);
+
+    pthread_mutex_lock(&v->locks[s]);
+    file_handler fh = open_file(v->fds[s], filename, CREATE);
+    pthread_mutex_unlock(&v->locks[s]);
+
+    return fh.is_open ? 0 : -1;
+}
+
+int volume_read(fs_volume *v, const char *filename, int32_t pos, int32_t n, char *buffer) {
+    int s = volume_shard_for(v, filename);
+    int r = -1;
+
+    pthread_mutex_lock(&v->locks[s]);
+    int idx = find_file_by_name(v->fds[s], filename);
+    if (idx != -1) {
+        file_handler fh = { idx, 0, 1 };
+        r = fs_read(v->fds[s], &fh, pos, n, buffer);
+    }
+    pthread_mutex_unlock(&v->locks[s]);
+    return r;
+}
+
+int volume_write(fs_volume *v, const char *filename, int32_t pos, const char *buffer, int32_t n) {
+    int s = volume_shard_for(v, filename);
+    int r = -1;
+
+    pthread_mutex_lock(&v->locks[s]);
+    int idx = find_file_by_name(v->fds[s], filename);
+    if (idx != -1) {
+        file_handler fh = { idx, 0, 1 };
+        r = fs_write(v->fds[s], &fh, pos, buffer, n);
+    }
+    pthread_mutex_unlock(&v->locks[s]);
+    return r;
+}
+
+int volume_rm(fs_volume *v, const char *filename) {
+    int s = volume_shard_for(v, filename);
+    int r = -1;
+
+    pthread_mutex_lock(&v->locks[s]);
+    int idx = find_file_by_name(v->fds[s], filename);
+    if (idx != -1) {
+        file_handler fh = { idx, 0, 1 };
+        r = rm_file(v->fds[s], &fh);
+    }
+    pthread_mutex_unlock(&v->locks[s]);
+    return r;
+}
+
+int volume_stat(fs_volume *v, const char *filename, file_metadata *meta) {
+    int s = volume_shard_for(v, filename);
+    int r = -1;
+
+    pthread_mutex_lock(&v->locks[s]);
+    int idx = find_file_by_name(v->fds[s], filename);
+    if (idx != -1)
+        r = read_metadata(v->fds[s], idx, meta);
+    pthread_mutex_unlock(&v->locks[s]);
+    return r;
+}
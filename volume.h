@@ -0,0 +1,33 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "filesystem.h"
+
+// Sharded volume: files spread over several image files by name hash.
+// Each shard is an ordinary image (own header, metadata table and free
+// list) with its own fd and lock, so calls on different shards run in
+// parallel and shards can live on different disks. The shard paths must be
+// given in the same order every time, since the order decides routing.
+
+#define MAX_SHARDS 16
+
+typedef struct {
+    int shard_count;
+    int fds[MAX_SHARDS];
+    pthread_mutex_t locks[MAX_SHARDS];
+} fs_volume;
+
+int volume_open(fs_volume *v, const char *const *paths, int count, int32_t shard_size);
+void volume_close(fs_volume *v);
+int volume_shard_for(const fs_volume *v, const char *filename);
+
+int volume_create(fs_volume *v, const char *filename);
+int volume_read(fs_volume *v, const char *filename, int32_t pos, int32_t n, char *buffer);
+int volume_write(fs_volume *v, const char *filename, int32_t pos, const char *buffer, int32_t n);
+int volume_rm(fs_volume *v, const char *filename);
+int volume_stat(fs_volume *v, const char *filename, file_metadata *meta);
+
+#endif
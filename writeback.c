@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "filesystem.h"
+#include "writeback.h"
+
+typedef struct {
+    int64_t lo, hi;     // dirty span, empty when lo == hi
+    int64_t bytes;      // bytes written into it since the last flush
+} dirty_range;
+
+typedef struct {
+    int fd;                      // -1 = unused
+    int running;
+    int interval_ms;
+    int64_t dirty_limit;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;         // dirty limit reached, or stop
+
+    dirty_range dirty[WB_REGIONS];
+    int64_t dirty_bytes;
+
+    long flushes;
+    int64_t flushed_bytes;
+    double max_flush_ms;
+} wb_image;
+
+static wb_image images[MAX_WRITEBACK_IMAGES];
+static int images_ready = 0;
+
+static const char *region_names[WB_REGIONS] = {
+    "header", "metadata", "free list", "maps", "data"
+};
+
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int region_of(int64_t offset) {
+    if (offset < (int64_t)sizeof(file_system_header)) return WB_HEADER;
+    if (offset < free_block_offset(0)) return WB_METADATA;
+    if (offset < extent_ref_offset(0)) return WB_FREE_LIST;
+    if (offset < data_region_offset()) return WB_MAPS;
+    return WB_DATA;
+}
+
+static wb_image *find_image(int fd) {
+    if (!images_ready) return NULL;
+    for (int i = 0; i < MAX_WRITEBACK_IMAGES; i++) {
+        if (images[i].fd == fd) return &images[i];
+    }
+    return NULL;
+}
+
+/* Take the dirty ranges and make them durable: data first, then one
+ * fdatasync for everything. Returns the bytes flushed, or -1. */
+static int64_t flush_image(wb_image *img) {
+    dirty_range dirty[WB_REGIONS];
+
+    pthread_mutex_lock(&img->lock);
+    memcpy(dirty, img->dirty, sizeof(dirty));
+    memset(img->dirty, 0, sizeof(img->dirty));
+    int64_t bytes = img->dirty_bytes;
+    img->dirty_bytes = 0;
+    pthread_mutex_unlock(&img->lock);
+
+    if (bytes == 0) return 0;
+
+    double t0 = now_ms();
+    int rc = 0;
+
+    // File data before the tables that point at it
+    dirty_range *d = &dirty[WB_DATA];
+    if (d->hi > d->lo &&
+        sync_file_range(img->fd, d->lo, d->hi - d->lo, SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+        rc = -1;
+
+    for (int r = 0; r < WB_DATA; r++) {
+        if (dirty[r].hi > dirty[r].lo)
+            sync_file_range(img->fd, dirty[r].lo, dirty[r].hi - dirty[r].lo, SYNC_FILE_RANGE_WRITE);
+    }
+    if (fdatasync(img->fd) != 0) rc = -1;
+
+    double took = now_ms() - t0;
+    pthread_mutex_lock(&img->lock);
+    img->flushes++;
+    img->flushed_bytes += bytes;
+    if (took > img->max_flush_ms) img->max_flush_ms = took;
+    pthread_mutex_unlock(&img->lock);
+
+    return rc == 0 ? bytes : -1;
+}
+
+static void *flusher(void *arg) {
+    wb_image *img = arg;
+
+    pthread_mutex_lock(&img->lock);
+    while (img->running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += img->interval_ms / 1000;
+        deadline.tv_nsec += (img->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (img->running && img->dirty_bytes < img->dirty_limit) {
+            if (pthread_cond_timedwait(&img->wake, &img->lock, &deadline) == ETIMEDOUT) break;
+        }
+        if (!img->running) break;
+
+        pthread_mutex_unlock(&img->lock);
+        if (flush_image(img) == -1)
+            fprintf(stderr, "writeback: flush failed on fd %d\n", img->fd);
+        pthread_mutex_lock(&img->lock);
+    }
+    pthread_mutex_unlock(&img->lock);
+    return NULL;
+}
+
+int writeback_start(int fd, int interval_ms, int64_t dirty_limit) {
+    if (interval_ms <= 0) return 0;
+
+    if (!images_ready) {
+        for (int i = 0; i < MAX_WRITEBACK_IMAGES; i++) images[i].fd = -1;
+        images_ready = 1;
+    }
+    if (find_image(fd)) return -1;
+
+    wb_image *img = find_image(-1);
+    if (!img) return -1;
+
+    memset(img, 0, sizeof(*img));
+    img->interval_ms = interval_ms;
+    img->dirty_limit = dirty_limit > 0 ? dirty_limit : INT64_MAX;
+    img->running = 1;
+    pthread_mutex_init(&img->lock, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&img->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Published before the thread starts so writes are tracked from here on
+    img->fd = fd;
+    if (pthread_create(&img->thread, NULL, flusher, img) != 0) {
+        img->fd = -1;
+        pthread_cond_destroy(&img->wake);
+        pthread_mutex_destroy(&img->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* Stop the flusher after one last flush of whatever is still dirty. */
+void writeback_stop(int fd) {
+    wb_image *img = find_image(fd);
+    if (!img) return;
+
+    pthread_mutex_lock(&img->lock);
+    img->running = 0;
+    pthread_cond_signal(&img->wake);
+    pthread_mutex_unlock(&img->lock);
+    pthread_join(img->thread, NULL);
+
+    flush_image(img);
+    img->fd = -1;
+    pthread_cond_destroy(&img->wake);
+    pthread_mutex_destroy(&img->lock);
+}
+
+void writeback_note(int fd, int64_t offset, int64_t len) {
+    wb_image *img = find_image(fd);
+    if (!img || len <= 0) return;
+
+    dirty_range *d = &img->dirty[region_of(offset)];
+
+    pthread_mutex_lock(&img->lock);
+    if (d->hi == d->lo) {
+        d->lo = offset;
+        d->hi = offset + len;
+    } else {
+        if (offset < d->lo) d->lo = offset;
+        if (offset + len > d->hi) d->hi = offset + len;
+    }
+    d->bytes += len;
+    img->dirty_bytes += len;
+    if (img->dirty_bytes >= img->dirty_limit)
+        pthread_cond_signal(&img->wake);
+    pthread_mutex_unlock(&img->lock);
+}
+
+/* Barrier: everything written to fd before the call is durable on return.
+ * fdatasync runs even with nothing left dirty, since a flush the flusher
+ * already took may still be in progress. */
+int writeback_sync(int fd) {
+    wb_image *img = find_image(fd);
+    if (img && flush_image(img) == -1) return -1;
+    return fdatasync(fd);
+}
+
+void writeback_stats(int fd) {
+    wb_image *img = find_image(fd);
+    if (!img) {
+        printf("Write-back: off (writes are synced only by 'sync').\n");
+        return;
+    }
+
+    pthread_mutex_lock(&img->lock);
+    printf("Write-back: every %d ms", img->interval_ms);
+    if (img->dirty_limit != INT64_MAX) printf(" or %lld dirty bytes", (long long)img->dirty_limit);
+    printf("\n");
+    for (int r = 0; r < WB_REGIONS; r++) {
+        const dirty_range *d = &img->dirty[r];
+        printf("  %-10s dirty %lld bytes", region_names[r], (long long)d->bytes);
+        if (d->hi > d->lo) printf(" in [%lld, %lld)", (long long)d->lo, (long long)d->hi);
+        printf("\n");
+    }
+    printf("  flushes %ld, %lld bytes, slowest %.2f ms\n", img->flushes,
+           (long long)img->flushed_bytes, img->max_flush_ms);
+    pthread_mutex_unlock(&img->lock);
+}
@@ -0,0 +1,25 @@
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+#include <stdint.h>
+
+// Background write-back. filesystem.c reports every range it writes; a
+// flusher thread per image makes them durable at most interval_ms later, or
+// sooner once dirty_limit bytes are pending, so foreground writes never wait
+// on the disk. Dirty data is pushed out with sync_file_range before the
+// fdatasync that commits the tables pointing at it.
+
+#define MAX_WRITEBACK_IMAGES 16
+
+enum { WB_HEADER, WB_METADATA, WB_FREE_LIST, WB_MAPS, WB_DATA, WB_REGIONS };
+
+// interval_ms <= 0 leaves the image without a flusher; dirty_limit <= 0
+// means flush on the interval only.
+int writeback_start(int fd, int interval_ms, int64_t dirty_limit);
+void writeback_stop(int fd);
+
+void writeback_note(int fd, int64_t offset, int64_t len);
+int writeback_sync(int fd);
+void writeback_stats(int fd);
+
+#endif